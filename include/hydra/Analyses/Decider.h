@@ -12,6 +12,10 @@ namespace llvm {
 }
 
 namespace hydra {
+  // what a spawn and its join cost, in instructions, on the chosen target;
+  // only work which takes longer than this is worth spawning
+  unsigned getSpawnCost();
+
   class Decider : public llvm::ModulePass {
   public:
     static char ID;
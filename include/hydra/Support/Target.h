@@ -0,0 +1,20 @@
+#ifndef HYDRA_TARGET_H
+#define HYDRA_TARGET_H
+
+namespace hydra {
+  // the runtime which transformed code calls into, chosen with opt's
+  // -hydra-target option
+  enum class Target {
+    KernelThreads, // a std::thread per spawn
+    ThreadPool,    // threading/ThreadPool.cpp, or a runtime with the same
+                   // interface (ProcessPool.cpp or RemotePool.cpp)
+    Shim           // threading/Shim.cpp, which picks a runtime at startup
+  };
+
+  Target getTarget();
+
+  // the Thread Pool and Shim hand back a task handle, and can group spawns
+  inline bool hasTaskHandles() { return getTarget() != Target::KernelThreads; }
+}
+
+#endif
@@ -4,6 +4,7 @@
 #include <map>
 #include <set>
 #include "llvm/Pass.h"
+#include "llvm/IR/DerivedTypes.h"
 
 namespace hydra {
   class MakeSpawnable : public llvm::ModulePass {
@@ -15,10 +16,15 @@ namespace hydra {
     virtual void releaseMemory() override;
     llvm::Function *getSpawnableFun(llvm::Function &F);
     bool isSpawnableFun(llvm::Function &F);
+    // the packed argument frame read by F's spawnable function: F's args in
+    // order, followed by F's return value if it has one
+    llvm::StructType *getFrameType(llvm::Function &F);
 
   private:
-    void addSpawnableFun(llvm::Function *F, llvm::Function *spF);
+    void addSpawnableFun(llvm::Function *F, llvm::Function *spF,
+                         llvm::StructType *frameTy);
     std::map<llvm::Function *, llvm::Function *> funsToSpawnableFuns;
+    std::map<llvm::Function *, llvm::StructType *> funsToFrameTypes;
     std::set<llvm::Function *> spawnableFuns;
 
   public: 
@@ -35,13 +41,21 @@ hydra::MakeSpawnable::getSpawnableFun(llvm::Function &F) {
   return (it != funsToSpawnableFuns.end() ? it->second : nullptr);
 }
 
+inline llvm::StructType *
+hydra::MakeSpawnable::getFrameType(llvm::Function &F) {
+  auto it = funsToFrameTypes.find(&F);
+  return (it != funsToFrameTypes.end() ? it->second : nullptr);
+}
+
 inline bool hydra::MakeSpawnable::isSpawnableFun(llvm::Function &F) {
   return spawnableFuns.count(&F) > 0;
 }
 
 inline void hydra::MakeSpawnable::addSpawnableFun(llvm::Function *F,
-                                                  llvm::Function *spF) {
+                                                  llvm::Function *spF,
+                                                  llvm::StructType *frameTy) {
   funsToSpawnableFuns[F] = spF;
+  funsToFrameTypes[F] = frameTy;
   spawnableFuns.insert(spF);
 }
 
@@ -9,6 +9,7 @@
 
 // llvm includes
 #include "llvm/Support/CFG.h"
+#include "llvm/Support/CommandLine.h"
 #include "llvm/Support/Debug.h"
 
 // hydra includes
@@ -17,7 +18,7 @@
 #include "hydra/Analyses/Profitability.h"
 #include "hydra/Support/FunAlgorithms.h"
 #include "hydra/Support/PrintCollection.h"
-#include "hydra/Support/TargetMacros.h"
+#include "hydra/Support/Target.h"
 
 using namespace llvm;
 using namespace hydra;
@@ -218,13 +219,22 @@ static unsigned getSpawnToJoinCost(const CallInst *spawn,
   }
 }
 
-#if KERNEL_THREADS
-  static constexpr unsigned spawnCost = 1000u;
-  static constexpr unsigned syncCost = 0u;
-#elif LIGHT_THREADS
-  static constexpr unsigned spawnCost = 100u;
-  static constexpr unsigned syncCost = 0u;
-#endif
+static constexpr unsigned syncCost = 0u;
+
+// a runtime which sends spawns elsewhere (e.g. threading/RemotePool.cpp) costs
+// far more per spawn, so only much bigger calls are worth spawning on it
+static cl::opt<unsigned>
+SpawnCost("spawn-cost",
+          cl::desc("Cost of a spawn and join, in instructions, when deciding "
+                   "what to spawn (default: 1000 for kernel threads, else "
+                   "100)"));
+
+unsigned hydra::getSpawnCost() {
+  if (SpawnCost.getNumOccurrences() > 0) {
+    return SpawnCost;
+  }
+  return getTarget() == Target::KernelThreads ? 1000u : 100u;
+}
 
 //------------------------------------------------------------------------------
 static bool
@@ -248,8 +258,8 @@ decide(const std::pair<const CallInst *, std::set<Instruction *>> &pair,
   DEBUG(dbgs() << "callerInsts is " << callerInsts << "\n");
 
   const unsigned serialCost{ calleeInsts + callerInsts };
-  const unsigned parallelCost{ spawnCost + std::max(calleeInsts, callerInsts) +
-                               syncCost };
+  const unsigned parallelCost{ getSpawnCost() +
+                               std::max(calleeInsts, callerInsts) + syncCost };
 
   DEBUG(dbgs() << "serialCost == " << serialCost << "\n");
   DEBUG(dbgs() << "parallelCost == " << parallelCost << "\n\n");
@@ -1,7 +1,7 @@
 #include "hydra/Analyses/Fitness.h"
 #include "hydra/Analyses/FunArgInfo.h"
 #include "hydra/Support/ForEachSCC.h"
-#include "hydra/Support/TargetMacros.h"
+#include "hydra/Support/Target.h"
 #include "llvm/Analysis/AliasAnalysis.h"
 #include "llvm/Analysis/CallGraph.h"
 #include "llvm/IR/Instructions.h"
@@ -62,18 +62,14 @@ static std::set<Instruction *> findJoinPoints(CallInst *ci, AliasAnalysis &AA) {
     DEBUG(dbgs() << "Early exit: join was trivial.\n");
     ret.insert(join);
     return ret;
-  } else // kernel threads must always have join at the end
-#if !KERNEL_THREADS
-      if (spawnBlock->getTerminator()->getNumSuccessors() == 0)
-#endif
-  {
+  } else if (!hasTaskHandles() ||
+             spawnBlock->getTerminator()->getNumSuccessors() == 0) {
+    // kernel threads must always have join at the end
     DEBUG(dbgs() << "Early exit: spawn is in exit block.\n");
     ret.insert(spawnBlock->getTerminator());
     return ret;
   }
 
-#if !KERNEL_THREADS
-
   std::deque<BasicBlock *> blocksToExplore;
   std::set<BasicBlock *> exploredBlocks;
 
@@ -112,8 +108,6 @@ static std::set<Instruction *> findJoinPoints(CallInst *ci, AliasAnalysis &AA) {
 
   assert(!ret.empty());
   return ret;
-
-#endif
 }
 
 // LLVM uses &Hello::ID to identify the pass, so its value is unimportant
@@ -0,0 +1,20 @@
+#include "hydra/Support/Target.h"
+#include "llvm/Support/CommandLine.h"
+
+using namespace llvm;
+using namespace hydra;
+
+// Transforms.so looks this up in Analyses.so, which is always loaded first
+static cl::opt<Target> TargetOpt(
+    "hydra-target", cl::desc("Runtime for the parallelised calls to use"),
+    cl::init(Target::ThreadPool),
+    cl::values(clEnumValN(Target::KernelThreads, "threads",
+                          "A std::thread per spawn"),
+               clEnumValN(Target::ThreadPool, "pool",
+                          "threading/ThreadPool.cpp (the default)"),
+               clEnumValN(Target::Shim, "shim",
+                          "threading/Shim.cpp, which picks a runtime when the "
+                          "program starts"),
+               clEnumValEnd));
+
+Target hydra::getTarget() { return TargetOpt; }
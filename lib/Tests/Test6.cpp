@@ -25,6 +25,8 @@ bool TestModule4::runOnModule(Module &M) {
       M.getOrInsertFunction("spawn_me", intTy, nullptr)) };
   Function *work{ cast<Function>(
       M.getOrInsertFunction("do_work", intTy, nullptr)) };
+  Function *siblings{ cast<Function>(
+      M.getOrInsertFunction("siblings", intTy, nullptr)) };
 
   // synthesise do_work
   addInstructions(2000u, *work);
@@ -65,6 +67,18 @@ bool TestModule4::runOnModule(Module &M) {
   BinaryOperator::Create(BinaryOperator::Sub, spawnMeResult,
                          ConstantInt::get(intTy, 4u), "useRes", mainExit);
   ReturnInst::Create(c, ConstantInt::get(intTy, 0u), mainExit);
+
+  // synthesise siblings, which calls spawn_me twice, and then do_work, before
+  // it uses either of spawn_me's results
+  auto *siblingsEntry = BasicBlock::Create(c, "siblingsEntry", siblings);
+  auto *first = CallInst::Create(spawnMe, args, "a", siblingsEntry);
+  auto *second = CallInst::Create(spawnMe, args, "b", siblingsEntry);
+  auto *moreWork = CallInst::Create(work, args, "w", siblingsEntry);
+  auto *sum = BinaryOperator::Create(BinaryOperator::Add, first, second, "s",
+                                     siblingsEntry);
+  auto *total = BinaryOperator::Create(BinaryOperator::Add, sum, moreWork,
+                                       "t", siblingsEntry);
+  ReturnInst::Create(c, total, siblingsEntry);
   return true;
 }
 
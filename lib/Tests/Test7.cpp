@@ -0,0 +1,207 @@
+#include "llvm/Pass.h"
+#include "llvm/IR/Module.h"
+#include "hydra/Support/FunAlgorithms.h"
+
+using namespace llvm;
+using namespace hydra;
+
+namespace {
+  class TestModule7 : public ModulePass {
+  public:
+    static char ID;
+    TestModule7() : ModulePass{ ID } {}
+    virtual bool runOnModule(Module &M) override;
+  };
+}
+
+char TestModule7::ID{ 0 };
+
+// start the loop in loop, entered from preheader, with an i64 induction
+// variable counting up from 0
+static PHINode *startLoop(BasicBlock *preheader, BasicBlock *loop) {
+  Type *const i64Ty{ Type::getInt64Ty(loop->getContext()) };
+  auto *i = PHINode::Create(i64Ty, 2u, "i", loop);
+  i->addIncoming(ConstantInt::get(i64Ty, 0u), preheader);
+  return i;
+}
+
+// finish the loop i counts, which goes round again while i + 1 < n and then
+// leaves for exit
+static void endLoop(PHINode *i, Value *n, BasicBlock *exit) {
+  BasicBlock *loop{ i->getParent() };
+  auto *next = BinaryOperator::Create(BinaryOperator::Add, i,
+                                      ConstantInt::get(i->getType(), 1u),
+                                      "i.next", loop);
+  auto *more = CmpInst::Create(BinaryOperator::ICmp, CmpInst::ICMP_ULT, next,
+                               n, "more", loop);
+  BranchInst::Create(loop, exit, more, loop);
+  i->addIncoming(next, loop);
+}
+
+// name F's arguments a and n, and return them
+static std::pair<Value *, Value *> arrayArgs(Function *F) {
+  auto it = F->arg_begin();
+  Argument *a{ &*it++ };
+  Argument *n{ &*it };
+  a->setName("a");
+  n->setName("n");
+  return std::make_pair(a, n);
+}
+
+bool TestModule7::runOnModule(Module &M) {
+  LLVMContext &c{ M.getContext() };
+  Type *const voidTy{ Type::getVoidTy(c) };
+  Type *const intTy{ Type::getInt32Ty(c) };
+  Type *const i64Ty{ Type::getInt64Ty(c) };
+  Type *const intPtrTy{ PointerType::getUnqual(intTy) };
+
+  Function *doall{ cast<Function>(
+      M.getOrInsertFunction("doall", voidTy, intPtrTy, i64Ty, nullptr)) };
+  Function *carried{ cast<Function>(
+      M.getOrInsertFunction("carried", voidTy, intPtrTy, i64Ty, nullptr)) };
+  Function *reduce{ cast<Function>(
+      M.getOrInsertFunction("reduce", intTy, intPtrTy, i64Ty, nullptr)) };
+  Function *guarded{ cast<Function>(
+      M.getOrInsertFunction("guarded", intTy, intPtrTy, i64Ty, nullptr)) };
+  Function *deferred{ cast<Function>(
+      M.getOrInsertFunction("deferred", voidTy, intPtrTy, i64Ty, nullptr)) };
+  Function *stale{ cast<Function>(
+      M.getOrInsertFunction("stale", voidTy, intPtrTy, i64Ty, nullptr)) };
+  Function *heavy{ cast<Function>(
+      M.getOrInsertFunction("heavy", intTy, intTy, nullptr)) };
+
+  // doall: a[i] = i * i, whose iterations are independent
+  auto args = arrayArgs(doall);
+  auto *entry = BasicBlock::Create(c, "entry", doall);
+  auto *loop = BasicBlock::Create(c, "loop", doall);
+  auto *exit = BasicBlock::Create(c, "exit", doall);
+  BranchInst::Create(loop, entry);
+  PHINode *i{ startLoop(entry, loop) };
+  auto *x = new TruncInst(i, intTy, "x", loop);
+  auto *sq = BinaryOperator::Create(BinaryOperator::Mul, x, x, "sq", loop);
+  auto *p = GetElementPtrInst::Create(args.first, i, "p", loop);
+  new StoreInst(sq, p, loop);
+  endLoop(i, args.second, exit);
+  ReturnInst::Create(c, exit);
+
+  // carried: a[i + 1] = a[i] + 1, so each iteration needs the one before
+  args = arrayArgs(carried);
+  entry = BasicBlock::Create(c, "entry", carried);
+  loop = BasicBlock::Create(c, "loop", carried);
+  exit = BasicBlock::Create(c, "exit", carried);
+  BranchInst::Create(loop, entry);
+  i = startLoop(entry, loop);
+  p = GetElementPtrInst::Create(args.first, i, "p", loop);
+  auto *v = new LoadInst(p, "v", loop);
+  auto *v1 = BinaryOperator::Create(BinaryOperator::Add, v,
+                                    ConstantInt::get(intTy, 1u), "v1", loop);
+  auto *i1 = BinaryOperator::Create(BinaryOperator::Add, i,
+                                    ConstantInt::get(i64Ty, 1u), "i1", loop);
+  auto *q = GetElementPtrInst::Create(args.first, i1, "q", loop);
+  new StoreInst(v1, q, loop);
+  endLoop(i, args.second, exit);
+  ReturnInst::Create(c, exit);
+
+  // reduce: the sum of a[i], which is only used after the loop, and which
+  // (as clang would have it for an int) doesn't overflow
+  args = arrayArgs(reduce);
+  entry = BasicBlock::Create(c, "entry", reduce);
+  loop = BasicBlock::Create(c, "loop", reduce);
+  exit = BasicBlock::Create(c, "exit", reduce);
+  BranchInst::Create(loop, entry);
+  i = startLoop(entry, loop);
+  auto *sum = PHINode::Create(intTy, 2u, "sum", loop);
+  p = GetElementPtrInst::Create(args.first, i, "p", loop);
+  v = new LoadInst(p, "v", loop);
+  auto *sumNext =
+      BinaryOperator::Create(BinaryOperator::Add, sum, v, "sum.next", loop);
+  sumNext->setHasNoSignedWrap(true);
+  sum->addIncoming(ConstantInt::get(intTy, 0u), entry);
+  sum->addIncoming(sumNext, loop);
+  endLoop(i, args.second, exit);
+  auto *total = PHINode::Create(intTy, 1u, "total", exit);
+  total->addIncoming(sumNext, loop);
+  ReturnInst::Create(c, total, exit);
+
+  // guarded: the sum of a[i] as in reduce, but only if n is positive, so the
+  // exit is reached from outside the loop too
+  args = arrayArgs(guarded);
+  entry = BasicBlock::Create(c, "entry", guarded);
+  auto *preheader = BasicBlock::Create(c, "preheader", guarded);
+  loop = BasicBlock::Create(c, "loop", guarded);
+  exit = BasicBlock::Create(c, "exit", guarded);
+  auto *any = CmpInst::Create(BinaryOperator::ICmp, CmpInst::ICMP_SGT,
+                              args.second, ConstantInt::get(i64Ty, 0u), "any",
+                              entry);
+  BranchInst::Create(preheader, exit, any, entry);
+  BranchInst::Create(loop, preheader);
+  i = startLoop(preheader, loop);
+  sum = PHINode::Create(intTy, 2u, "sum", loop);
+  p = GetElementPtrInst::Create(args.first, i, "p", loop);
+  v = new LoadInst(p, "v", loop);
+  sumNext =
+      BinaryOperator::Create(BinaryOperator::Add, sum, v, "sum.next", loop);
+  sum->addIncoming(ConstantInt::get(intTy, 0u), preheader);
+  sum->addIncoming(sumNext, loop);
+  endLoop(i, args.second, exit);
+  total = PHINode::Create(intTy, 2u, "total", exit);
+  total->addIncoming(ConstantInt::get(intTy, 0u), entry);
+  total->addIncoming(sumNext, loop);
+  ReturnInst::Create(c, total, exit);
+
+  // deferred: a[i + 1] = a[i] + heavy(i), which isn't DOALL, but can make
+  // its calls to heavy ahead of the rest of each iteration
+  args = arrayArgs(deferred);
+  entry = BasicBlock::Create(c, "entry", deferred);
+  loop = BasicBlock::Create(c, "loop", deferred);
+  exit = BasicBlock::Create(c, "exit", deferred);
+  BranchInst::Create(loop, entry);
+  i = startLoop(entry, loop);
+  x = new TruncInst(i, intTy, "x", loop);
+  Value *heavyArgs[] = { x };
+  auto *h = CallInst::Create(heavy, heavyArgs, "h", loop);
+  p = GetElementPtrInst::Create(args.first, i, "p", loop);
+  v = new LoadInst(p, "v", loop);
+  v1 = BinaryOperator::Create(BinaryOperator::Add, v, h, "v1", loop);
+  i1 = BinaryOperator::Create(BinaryOperator::Add, i,
+                              ConstantInt::get(i64Ty, 1u), "i1", loop);
+  q = GetElementPtrInst::Create(args.first, i1, "q", loop);
+  new StoreInst(v1, q, loop);
+  endLoop(i, args.second, exit);
+  ReturnInst::Create(c, exit);
+
+  // stale: g = heavy(i + g), whose calls can't be made ahead of the
+  // iterations before them, as each one's argument is the last one's result
+  auto *g = new GlobalVariable(M, intTy, false, GlobalValue::InternalLinkage,
+                               ConstantInt::get(intTy, 0u), "g");
+  args = arrayArgs(stale);
+  entry = BasicBlock::Create(c, "entry", stale);
+  loop = BasicBlock::Create(c, "loop", stale);
+  exit = BasicBlock::Create(c, "exit", stale);
+  BranchInst::Create(loop, entry);
+  i = startLoop(entry, loop);
+  x = new TruncInst(i, intTy, "x", loop);
+  v = new LoadInst(g, "v", loop);
+  v1 = BinaryOperator::Create(BinaryOperator::Add, x, v, "v1", loop);
+  Value *staleArgs[] = { v1 };
+  h = CallInst::Create(heavy, staleArgs, "h", loop);
+  new StoreInst(h, g, loop);
+  endLoop(i, args.second, exit);
+  ReturnInst::Create(c, exit);
+
+  // heavy: a functional function which costs far more than a spawn
+  Argument *arg{ &*heavy->arg_begin() };
+  arg->setName("x");
+  auto *heavyEntry = BasicBlock::Create(c, "entry", heavy);
+  Value *acc{ arg };
+  for (unsigned k{ 0u }; k < 200u; ++k) {
+    acc =
+        BinaryOperator::Create(BinaryOperator::Xor, acc, arg, "", heavyEntry);
+  }
+  ReturnInst::Create(c, acc, heavyEntry);
+
+  return true;
+}
+
+static RegisterPass<TestModule7> X("test-module-paralleliseloops",
+                                   "Generate Test Module 7", false, false);
@@ -2,32 +2,44 @@
 
 // STL includes
 #include <algorithm>
-#include <map>
-#include <random>
 #include <set>
+#include <vector>
 
 // hydra includes
 #include "hydra/Analyses/Decider.h"
 #include "hydra/Transforms/MakeSpawnable.h"
 #include "hydra/Support/FunAlgorithms.h"
-#include "hydra/Support/PrintCollection.h"
-#include "hydra/Support/TargetMacros.h"
+#include "hydra/Support/Target.h"
 
 // llvm includes
 #include "llvm/Pass.h"
 #include "llvm/ADT/Statistic.h"
+#include "llvm/Analysis/CFG.h"
+#include "llvm/IR/Constants.h"
 #include "llvm/IR/DerivedTypes.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/Module.h"
+#include "llvm/Support/CFG.h"
+#include "llvm/Support/CommandLine.h"
 #include "llvm/Support/Debug.h"
+#include "llvm/Support/ErrorHandling.h"
 #include "llvm/Transforms/Utils/BasicBlockUtils.h"
 
 STATISTIC(NumCallsParallelised, "Number of calls parallelised");
+STATISTIC(NumSyncGroups, "Number of sync groups created");
+STATISTIC(NumCallsRunInline, "Number of sibling calls left to run inline");
 
 using namespace llvm;
 using namespace hydra;
 
+static cl::opt<bool>
+SpawnEverySibling("spawn-every-sibling",
+                  cl::desc("Spawn every one of a block's calls which share "
+                           "their join points, rather than running the last "
+                           "of them in the spawning thread"),
+                  cl::init(false));
+
 namespace {
   class Hello : public ModulePass {
   public:
@@ -36,24 +48,28 @@ namespace {
     virtual void getAnalysisUsage(AnalysisUsage &Info) const override;
     virtual bool runOnModule(Module &M) override;
   private:
-    void generateCtors(const std::set<unsigned> &arities, Module &M,
-                       const unsigned maxargs);
+    void generateCtor(Module &M);
     void generateJoinAndDtor(Module &M);
     bool isNotJoinOrDtor(CallInst *ci) const;
     void createThread(CallInst *ci, Function *spawnableFun,
-                      const std::set<Instruction *> &joinPoints);
+                      StructType *frameTy,
+                      const std::set<Instruction *> &joinPoints,
+                      Value *group);
     std::vector<Value *> genSpawnArgs(CallInst *ci, Function *spawnableFun,
-                                      AllocaInst *&retVal);
+                                      StructType *frameTy, Value *&retVal);
     void createJoins(const std::set<Instruction *> &joinPoints, Value *id);
-    void handleReturnValue(CallInst *ci, AllocaInst *retVal);
-    std::map<unsigned, Constant *> ctors; // ctors indexed by arity
+    void handleReturnValue(CallInst *ci, Value *retVal);
+    Target target;
+    Constant *ctor;
     Constant *join;
-#if KERNEL_THREADS
+    // for kernel threads
     Constant *dtor;
     Type *threadTy;
-#elif LIGHT_THREADS
-    std::mt19937 twister; // for generating taskIDs
-#endif
+    // for targets with task handles
+    Constant *groupCtor;
+    Constant *groupJoin;
+    PointerType *taskTy;
+    StructType *groupTy;
   };
 }
 
@@ -61,11 +77,52 @@ namespace {
 char Hello::ID = 0;
 
 //------------------------------------------------------------------------------
-Hello::Hello() : ModulePass { ID }
-#if LIGHT_THREADS
-, twister{ std::random_device{}() }
-#endif
-{}
+Hello::Hello() : ModulePass { ID } {}
+
+//------------------------------------------------------------------------------
+// returns true if BB may run more than once per call of its function
+static bool inCycle(BasicBlock *BB) {
+  for (auto it = succ_begin(BB), e = succ_end(BB); it != e; ++it) {
+    if (isPotentiallyReachable(*it, BB)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+//------------------------------------------------------------------------------
+// returns the one of calls, which share their join points, that can be left
+// to run in the spawning thread while the others run elsewhere: the last of
+// them, if they're all in the same block and it only runs once before the
+// join. Returns nullptr if there isn't one.
+static CallInst *findInlineSibling(const std::vector<CallInst *> &calls) {
+  BasicBlock *BB{ calls.front()->getParent() };
+  if (SpawnEverySibling || calls.size() < 2u || inCycle(BB)) {
+    return nullptr;
+  }
+  for (auto *ci : calls) {
+    if (ci->getParent() != BB) {
+      return nullptr;
+    }
+  }
+  for (auto it = BB->rbegin(), e = BB->rend(); it != e; ++it) {
+    auto *ci = dyn_cast<CallInst>(&*it);
+    if (ci && std::find(calls.begin(), calls.end(), ci) != calls.end()) {
+      return ci;
+    }
+  }
+  llvm_unreachable("A call isn't in its own block!");
+}
+
+//------------------------------------------------------------------------------
+// allocate a ty in F's entry block, initialised to init
+static AllocaInst *createEntryAlloca(Function *F, Type *ty, const Twine &name,
+                                     Constant *init) {
+  Instruction *insertPt = &*F->getEntryBlock().getFirstInsertionPt();
+  auto *alloca = new AllocaInst(ty, name, insertPt);
+  new StoreInst(init, alloca, insertPt);
+  return alloca;
+}
 
 //------------------------------------------------------------------------------
 void Hello::getAnalysisUsage(AnalysisUsage &Info) const {
@@ -80,118 +137,140 @@ bool Hello::runOnModule(Module &M) {
   auto &D = getAnalysis<Decider>();
   auto &MS = getAnalysis<MakeSpawnable>();
 
-#if KERNEL_THREADS
-  // define the type of std::thread
   LLVMContext &c{ M.getContext() };
   Type *ts[1];
-  ts[0] = Type::getInt64Ty(c);
-  StructType *threadIDTy = StructType::create(c, ts, "class.std::thread::id");
-
-  ts[0] = threadIDTy;
-  threadTy = StructType::create(c, ts, "class.std::thread");
-#endif
-
-  std::set<unsigned> arities;
-  for (const auto F : MS) {
-    arities.insert(F->getArgumentList().size());
+  target = getTarget();
+
+  if (target == Target::KernelThreads) {
+    // define the type of std::thread
+    ts[0] = Type::getInt64Ty(c);
+    StructType *threadIDTy =
+        StructType::create(c, ts, "class.std::thread::id");
+
+    ts[0] = threadIDTy;
+    threadTy = StructType::create(c, ts, "class.std::thread");
+  } else {
+    // a task handle is opaque, while a group is a single counter. Another
+    // pass (e.g. -paralleliseloops) may have declared them already.
+    StructType *taskStructTy{ M.getTypeByName("struct.hydra_task") };
+    if (!taskStructTy) {
+      taskStructTy = StructType::create(c, "struct.hydra_task");
+    }
+    taskTy = PointerType::getUnqual(taskStructTy);
+    groupTy = M.getTypeByName("struct.hydra_group");
+    if (!groupTy) {
+      ts[0] = Type::getInt32Ty(c);
+      groupTy = StructType::create(c, ts, "struct.hydra_group");
+    }
   }
 
-  DEBUG(printCollection(arities, dbgs(), "Arities"));
-
-  // early exit - if arities is empty, spawn nothing
-  if (arities.size() == 0u) {
+  // early exit - if there are no spawnable functions, spawn nothing
+  if (MS.begin() == MS.end()) {
     DEBUG(dbgs() << "Early exit: nothing to spawn.\n");
     return false;
   }
-  const unsigned maxargs{ *--arities.end() };
 
-  generateCtors(arities, M, maxargs);
+  generateCtor(M);
   generateJoinAndDtor(M);
   
+  // calls in the same function with the same join points are joined all at
+  // once, as a sync group; so is any call which may be spawned repeatedly
+  // before it's joined. Every other call is joined through its own handle.
+  // Of a group of calls in one block, the last runs inline instead, as the
+  // spawning thread would otherwise only wait for the others at the join.
+  struct CallGroup {
+    Function *F;
+    const std::set<Instruction *> *joinPoints;
+    std::vector<CallInst *> calls;
+  };
+  std::vector<CallGroup> groups;
+
   std::for_each(D.join_begin(), D.join_end(),
                 [&](decltype(*D.join_begin()) pair) {
-    auto *spawnableFun = MS.getSpawnableFun(*pair.first->getCalledFunction());
-    assert(spawnableFun && "Spawnable function not found in MakeSpawnable!");
-    createThread(pair.first, spawnableFun, pair.second);
-    ++NumCallsParallelised;
-    pair.first->eraseFromParent();
+    Function *F{ pair.first->getParent()->getParent() };
+    auto it = std::find_if(groups.begin(), groups.end(),
+                           [&](const CallGroup &g) {
+      return g.F == F && *g.joinPoints == pair.second;
+    });
+    if (it == groups.end()) {
+      groups.push_back(CallGroup{ F, &pair.second, {} });
+      it = groups.end() - 1;
+    }
+    it->calls.push_back(pair.first);
   });
 
+  for (const auto &g : groups) {
+    std::vector<CallInst *> spawned{ g.calls };
+    if (CallInst *inlined = findInlineSibling(g.calls)) {
+      DEBUG(dbgs() << "Running inline: ");
+      DEBUG(inlined->print(dbgs()));
+      DEBUG(dbgs() << "\n");
+      spawned.erase(std::find(spawned.begin(), spawned.end(), inlined));
+      ++NumCallsRunInline;
+    }
+
+    Value *group{ nullptr };
+    if (target != Target::KernelThreads &&
+        (spawned.size() > 1u || inCycle(spawned.front()->getParent()))) {
+      group = createEntryAlloca(g.F, groupTy, "group",
+                                ConstantAggregateZero::get(groupTy));
+      createJoins(*g.joinPoints, group);
+      ++NumSyncGroups;
+    }
+
+    for (auto *ci : spawned) {
+      auto *spawnableFun = MS.getSpawnableFun(*ci->getCalledFunction());
+      assert(spawnableFun && "Spawnable function not found in MakeSpawnable!");
+      auto *frameTy = MS.getFrameType(*ci->getCalledFunction());
+      assert(frameTy && "Frame type not found in MakeSpawnable!");
+      createThread(ci, spawnableFun, frameTy, *g.joinPoints, group);
+      ++NumCallsParallelised;
+      ci->eraseFromParent();
+    }
+  }
+
   return true;
 }
 
 //------------------------------------------------------------------------------
-void Hello::generateCtors(const std::set<unsigned> &arities, Module &M,
-                          const unsigned maxargs) {
+void Hello::generateCtor(Module &M) {
   LLVMContext &c{ M.getContext() };
 
-  // kernal threads sig: (std::thread *, function *, args *...)
-  // lightw threads sig: (task, function *, args *...)
-  // baseArgs is num of args to spawn a 0-arg function
-#if KERNEL_THREADS || LIGHT_THREADS
-  constexpr unsigned baseArgs = 2u;
-#endif
-
-  std::vector<Type *> ctorSig(baseArgs);
-
-#if KERNEL_THREADS
-  ctorSig[0] = PointerType::getUnqual(threadTy);
-#elif LIGHT_THREADS
-  ctorSig[0] = Type::getInt32Ty(c);
-#endif
-
+  // every spawnable function takes a single pointer to its packed frame
+  // kernal threads sig: void (std::thread *, void (*)(void *), void **)
+  // lightw threads sig: hydra_task *(void (*)(void *), void *, size_t)
+  //  and for a group: void (hydra_group *, void (*)(void *), void *, size_t)
+  // where the size_t is the frame's size, for runtimes which copy it
   Type *voidStarTy{ PointerType::getUnqual(Type::getInt8Ty(c)) };
-
-  // build the function name from 4 pieces
-  // s1 and s2 will grow with additional arguments
-  // the function name depends on the threading model
-#if KERNEL_THREADS
-  const std::string s0{ "_ZNSt6threadC2IRFv" };
-  const std::string s1{ "P" };
-  std::string s2{ "v" };
-  const std::string s3{ "EJ" };
-  std::string s4{ "RS1_" };
-  const std::string s5{ "EEEOT_DpOT0_" };
-  const std::string deltaS2{ "S1_" };
-  const std::string deltaS4{ "S4_" };
-  Type *ctorArgTy{ PointerType::getUnqual(voidStarTy) };
-#elif LIGHT_THREADS
-  const std::string s0{ "_Z5spawnjPFv" };
-  const std::string s1{ "P" };
-  std::string s2{ "v" };
-  const std::string s3{ "E" };
-  std::string s4{ "S_" };
-  const std::string s5{ "" };
-  const std::string deltaS2{ "S_" };
-  const std::string deltaS4{ "S_" };
-  Type *ctorArgTy{ voidStarTy };
-#endif
-
-  std::vector<Type *> args;
-
-  // s1 and s4 are not present in the first name
-  std::string name = s0 + s2 + s3 + s5;
-
-  for (unsigned i = 0u; i <= maxargs; ++i) {
-    if (arities.count(i)) {
-      ctorSig[baseArgs - 1u] = PointerType::getUnqual(
-          FunctionType::get(Type::getVoidTy(c), args, false));
-      FunctionType *ctorTy =
-          FunctionType::get(Type::getVoidTy(c), ctorSig, false);
-      ctors[i] = M.getOrInsertFunction(name, ctorTy);
-    }
-
-    // extend ctor's signature
-    ctorSig.push_back(ctorArgTy);
-
-    // extend the name
-    s2 += deltaS2;
-    s4 += deltaS4;
-    name = s0 + s1 + s2 + s3 + s4 + s5;
-
-    // extend f's signature
-    args.push_back(voidStarTy);
+  Type *fTs[1] = { voidStarTy };
+  Type *fTy{ PointerType::getUnqual(
+      FunctionType::get(Type::getVoidTy(c), fTs, false)) };
+
+  if (target == Target::KernelThreads) {
+    Type *ctorSig[] = { PointerType::getUnqual(threadTy), fTy,
+                        PointerType::getUnqual(voidStarTy) };
+    FunctionType *ctorTy =
+        FunctionType::get(Type::getVoidTy(c), ctorSig, false);
+    ctor = M.getOrInsertFunction("_ZNSt6threadC2IRFvPvEJRS1_EEEOT_DpOT0_",
+                                 ctorTy);
+    return;
   }
+
+  // the Shim has the same signatures as the Thread Pool, with C names
+  const bool shim{ target == Target::Shim };
+  Type *sizeTy{ Type::getInt64Ty(c) };
+  Type *ctorSig[] = { fTy, voidStarTy, sizeTy };
+  FunctionType *ctorTy = FunctionType::get(taskTy, ctorSig, false);
+  ctor = M.getOrInsertFunction(shim ? "hydra_spawn" : "_Z5spawnPFvPvES_m",
+                               ctorTy);
+
+  Type *groupCtorSig[] = { PointerType::getUnqual(groupTy), fTy, voidStarTy,
+                           sizeTy };
+  FunctionType *groupCtorTy =
+      FunctionType::get(Type::getVoidTy(c), groupCtorSig, false);
+  groupCtor = M.getOrInsertFunction(
+      shim ? "hydra_group_spawn" : "_Z5spawnP11hydra_groupPFvPvES1_m",
+      groupCtorTy);
 }
 
 //------------------------------------------------------------------------------
@@ -199,60 +278,68 @@ void Hello::generateJoinAndDtor(Module &M) {
   LLVMContext &c{ M.getContext() };
   Type *ts[1];
 
-#if LIGHT_THREADS
+  if (target == Target::KernelThreads) {
+    // the dtor signature is (std::thread *)
+    ts[0] = PointerType::getUnqual(threadTy);
+    FunctionType *dtorTy = FunctionType::get(Type::getVoidTy(c), ts, false);
 
-  ts[0] = Type::getInt32Ty(c);
-  FunctionType *joinTy = FunctionType::get(Type::getVoidTy(c), ts, false);
-  join = M.getOrInsertFunction("_Z4joinj", joinTy);
-
-#elif KERNEL_THREADS
-
-  // the dtor signature is (std::thread *)
-  ts[0] = PointerType::getUnqual(threadTy);
-  FunctionType *dtorTy = FunctionType::get(Type::getVoidTy(c), ts, false);
+    // join has same signature as dtor
+    join = M.getOrInsertFunction("_ZNSt6thread4joinEv", dtorTy);
+    dtor = M.getOrInsertFunction("_ZNSt6threadD2Ev", dtorTy);
+    return;
+  }
 
-  // join has same signature as dtor
-  join = M.getOrInsertFunction("_ZNSt6thread4joinEv", dtorTy);
-  dtor = M.getOrInsertFunction("_ZNSt6threadD2Ev", dtorTy);
+  const bool shim{ target == Target::Shim };
+  ts[0] = taskTy;
+  FunctionType *joinTy = FunctionType::get(Type::getVoidTy(c), ts, false);
+  join = M.getOrInsertFunction(shim ? "hydra_join" : "_Z4joinP10hydra_task",
+                               joinTy);
 
-#endif
+  ts[0] = PointerType::getUnqual(groupTy);
+  FunctionType *groupJoinTy = FunctionType::get(Type::getVoidTy(c), ts, false);
+  groupJoin = M.getOrInsertFunction(
+      shim ? "hydra_group_join" : "_Z4joinP11hydra_group", groupJoinTy);
 }
 
 //------------------------------------------------------------------------------
 inline bool Hello::isNotJoinOrDtor(CallInst *ci) const {
   Function *fun = ci->getCalledFunction();
-  return (fun != join)
-#if KERNEL_THREADS
-    && (fun != dtor)
-#endif
-    ;
+  return (fun != join) && (target == Target::KernelThreads ? fun != dtor
+                                                           : fun != groupJoin);
 }
 
 //------------------------------------------------------------------------------
+// if group is not null, ci is spawned into group, whose joins already exist
 void Hello::createThread(CallInst *ci, Function *spawnableFun,
-                         const std::set<Instruction *> &joinPoints) {
+                         StructType *frameTy,
+                         const std::set<Instruction *> &joinPoints,
+                         Value *group) {
   DEBUG(dbgs() << "Hello::createThread()\n");
 
-  AllocaInst *retVal{ nullptr };
-  auto args = genSpawnArgs(ci, spawnableFun, retVal);
-
-  const auto numArgs = spawnableFun->getArgumentList().size();
-
-  assert(args.size() == numArgs + 2u && "Number of args differs!");
-
-  auto ctorIt = ctors.find(numArgs);
-
-  assert(ctorIt != ctors.end() && "no ctor in ctors!");
-  assert(cast<Function>(ctorIt->second)->getArgumentList().size() ==
-             args.size() &&
-         "wrong ctor in ctors!");
-
-  CallInst::Create(ctorIt->second, args, "", ci);
-
-  // the join function needs the first ctor arg
-  std::vector<Value *> jargs{ args[0] };
-  Value *id{ args[0] };
-  createJoins(joinPoints, id);
+  Value *retVal{ nullptr };
+  auto args = genSpawnArgs(ci, spawnableFun, frameTy, retVal);
+
+  assert(args.size() == 3u && "Number of args differs!");
+
+  if (target == Target::KernelThreads) {
+    assert(!group && "Kernel threads can't be grouped!");
+
+    CallInst::Create(ctor, args, "", ci);
+
+    // the join function needs the first ctor arg
+    createJoins(joinPoints, args[0]);
+  } else if (group) {
+    Value *groupArgs[] = { group, args[0], args[1], args[2] };
+    CallInst::Create(groupCtor, groupArgs, "", ci);
+  } else {
+    // keep the handle where every join point can load it; it starts off null
+    // so that a join on a path which didn't spawn does nothing
+    auto *slot = createEntryAlloca(ci->getParent()->getParent(), taskTy,
+                                   "task", ConstantPointerNull::get(taskTy));
+    auto *handle = CallInst::Create(ctor, args, "", ci);
+    new StoreInst(handle, slot, ci);
+    createJoins(joinPoints, slot);
+  }
 
   // if the functions returned a value, swap all uses of that value with the
   // value returned by our spawned thread, which is at the address of retVal
@@ -264,88 +351,80 @@ void Hello::createThread(CallInst *ci, Function *spawnableFun,
 //------------------------------------------------------------------------------
 std::vector<Value *> Hello::genSpawnArgs(CallInst *callInst,
                                          Function *spawnableFun,
-                                         AllocaInst *&retVal) {
+                                         StructType *frameTy,
+                                         Value *&retVal) {
   DEBUG(dbgs() << "Hello::genSpawnArgs()\n");
 
   LLVMContext &c{ callInst->getContext() };
 
   Type *voidStarTy{ PointerType::getUnqual(Type::getInt8Ty(c)) };
+  Type *int32Ty{ Type::getInt32Ty(c) };
 
   // in kernel threads, need to pass the threadID as an arg
-  // in light threads, need a "task" (random number) as an arg
-#if KERNEL_THREADS
-  auto *allocaThread = new AllocaInst(threadTy, "t", callInst);
-  std::vector<Value *> args{ allocaThread, spawnableFun };
-#elif LIGHT_THREADS
-  std::vector<Value *> args{
-    ConstantInt::get(Type::getInt32Ty(c),
-                     std::uniform_int_distribution<unsigned>{}(twister)),
-    spawnableFun
-  };
-#endif
-
-  for (unsigned i = 0u, e = callInst->getNumArgOperands(); i < e; ++i) {
-    Value *arg = callInst->getArgOperand(i);
-    Type *argTy = arg->getType();
-
-    // if arg is not a pointer, need to store it so we can take its address
-    Value *castarg;
-    if (argTy->isPointerTy()) {
-      castarg = arg;
-    } else {
-      castarg = new AllocaInst(argTy, "", callInst);
-      new StoreInst(arg, castarg, callInst);
-    }
-
-    assert(castarg->getType()->isPointerTy());
-    auto bc = new BitCastInst(castarg, voidStarTy, "", callInst);
-
-    // for light threads, we just use bc
-#if LIGHT_THREADS
-    args.push_back(bc);
+  std::vector<Value *> args;
+  if (target == Target::KernelThreads) {
+    args.push_back(new AllocaInst(threadTy, "t", callInst));
+  }
+  args.push_back(spawnableFun);
 
-    // for kernel threads, need to store castarg to get a void **
-#elif KERNEL_THREADS
-    auto argVal = new AllocaInst(voidStarTy, "", callInst);
-    new StoreInst(bc, argVal, callInst);
+  // pack every arg into a single frame, which must outlive the join
+  auto *frame = new AllocaInst(frameTy, "frame", callInst);
 
-    args.push_back(argVal);
+  const unsigned numArgs{ callInst->getNumArgOperands() };
+  for (unsigned i = 0u; i < numArgs; ++i) {
+    Value *idx[] = { ConstantInt::get(int32Ty, 0u),
+                     ConstantInt::get(int32Ty, i) };
+    auto gep = GetElementPtrInst::Create(frame, idx, "", callInst);
+    new StoreInst(callInst->getArgOperand(i), gep, callInst);
+  }
 
-#endif
+  // the return value, if any, is written to the frame's last field
+  if (frameTy->getNumElements() > numArgs) {
+    Value *idx[] = { ConstantInt::get(int32Ty, 0u),
+                     ConstantInt::get(int32Ty, numArgs) };
+    retVal = GetElementPtrInst::Create(frame, idx, "", callInst);
   }
 
-  Type *returnTy{ callInst->getCalledFunction()->getReturnType() };
-  const bool returnsVal{ returnTy != Type::getVoidTy(c) };
-  if (returnsVal) {
-    retVal = new AllocaInst(returnTy, "", callInst);
-    auto bc = new BitCastInst(retVal, voidStarTy, "", callInst);
-    // in kernel threads, need to store bc to get a void **
-#if KERNEL_THREADS
-    auto retArg = new AllocaInst(voidStarTy, "", callInst);
-    new StoreInst(bc, retArg, callInst);
-    args.push_back(retArg);
-#elif LIGHT_THREADS
+  auto bc = new BitCastInst(frame, voidStarTy, "", callInst);
+
+  if (target == Target::KernelThreads) {
+    // for kernel threads, need to store bc to get a void **
+    auto frameArg = new AllocaInst(voidStarTy, "", callInst);
+    new StoreInst(bc, frameArg, callInst);
+    args.push_back(frameArg);
+  } else {
+    // otherwise, we just use bc, along with the frame's size
     args.push_back(bc);
-#endif
+    args.push_back(ConstantExpr::getSizeOf(frameTy));
   }
 
   return args;
 }
 
 //------------------------------------------------------------------------------
+// id is a std::thread in kernel threads; in light threads, it's a sync group
+// or the slot holding a task handle
 void Hello::createJoins(const std::set<Instruction *> &joinPoints, Value *id) {
   Value *jargs[] = { id };
 
   for (auto *joinPoint : joinPoints) {
-    CallInst::Create(join, jargs, "", joinPoint);
-#if KERNEL_THREADS
-    CallInst::Create(dtor, jargs, "", joinPoint);
-#endif
+    if (target == Target::KernelThreads) {
+      CallInst::Create(join, jargs, "", joinPoint);
+      CallInst::Create(dtor, jargs, "", joinPoint);
+    } else if (id->getType() == PointerType::getUnqual(groupTy)) {
+      CallInst::Create(groupJoin, jargs, "", joinPoint);
+    } else {
+      // a handle is only valid until it's joined, and a path may pass
+      // through more than one join point, so clear it after each join
+      jargs[0] = new LoadInst{ id, "", joinPoint };
+      CallInst::Create(join, jargs, "", joinPoint);
+      new StoreInst(ConstantPointerNull::get(taskTy), id, joinPoint);
+    }
   }
 }
 
 //------------------------------------------------------------------------------
-void Hello::handleReturnValue(CallInst *ci, AllocaInst *retVal) {
+void Hello::handleReturnValue(CallInst *ci, Value *retVal) {
   DEBUG(dbgs() << "Hello::handleReturnValue()\n");
   assert(retVal);
 
@@ -5,6 +5,8 @@
 #include "hydra/Analyses/Decider.h"
 #include "hydra/Transforms/MakeSpawnable.h"
 #include "llvm/ADT/Statistic.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/DerivedTypes.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/Module.h"
 #include "llvm/Support/Debug.h"
@@ -42,19 +44,25 @@ bool MakeSpawnable::runOnModule(Module &M) {
     const bool returnsVal{ F->getReturnType() != Type::getVoidTy(c) };
     auto &fArgList = F->getArgumentList();
 
-    // create the new function signature with F's arglist length, plus 1 for ret
-    const auto numArgs = returnsVal ? fArgList.size() + 1 : fArgList.size();
+    // the frame holds each of F's args by value, plus a slot for the return
+    std::vector<Type *> fields;
+    fields.reserve(fArgList.size() + 1u);
 
-    std::vector<Type *> funSig;
-    funSig.reserve(numArgs);
-
-    Type *const voidStarTy{ PointerType::getUnqual(Type::getInt8Ty(c)) };
+    for (auto &arg : fArgList) {
+      fields.push_back(arg.getType());
+    }
 
-    for (unsigned i{ 0u }; i < numArgs; ++i) {
-      funSig.push_back(voidStarTy);
+    if (returnsVal) {
+      fields.push_back(F->getReturnType());
     }
 
-    FunctionType *fTy{ FunctionType::get(Type::getVoidTy(c), funSig, false) };
+    StructType *frameTy{ StructType::create(
+        c, fields, ("_Frame_" + F->getName()).str()) };
+
+    // every spawnable function has the same signature: void (i8 *frame)
+    Type *const voidStarTy{ PointerType::getUnqual(Type::getInt8Ty(c)) };
+    Type *ts[1] = { voidStarTy };
+    FunctionType *fTy{ FunctionType::get(Type::getVoidTy(c), ts, false) };
 
     std::string name{ ("_Spawnable_" + F->getName()).str() };
 
@@ -63,46 +71,42 @@ bool MakeSpawnable::runOnModule(Module &M) {
         Function::Create(fTy, Function::InternalLinkage, name, &M)) };
 
     BasicBlock *BB{ BasicBlock::Create(c, "entry", spF) };
-    
-    auto &spFArgList = spF->getArgumentList();
-
-    // cast all of spF's args to F's args
-    std::vector<Value *> castArgs;
-    for (auto fArgIt = fArgList.begin(), spFArgIt = spFArgList.begin();
-         fArgIt != fArgList.end(); ++fArgIt, ++spFArgIt) {
-      Type *ty{ fArgIt->getType() };
-      
+
+    auto *frame = new BitCastInst{ &spF->getArgumentList().front(),
+                                   PointerType::getUnqual(frameTy), "frame",
+                                   BB };
+
+    // load each of F's args out of the frame
+    Type *const int32Ty{ Type::getInt32Ty(c) };
+    std::vector<Value *> frameArgs;
+    for (unsigned i{ 0u }, e = fArgList.size(); i < e; ++i) {
       DEBUG(dbgs() << "Dealing with argument of type ");
-      DEBUG(ty->print(dbgs()));
+      DEBUG(fields[i]->print(dbgs()));
       DEBUG(dbgs() << "\n");
 
-      // check if ty is a pointer type; if not, need to do a load
-      if (ty->isPointerTy()) {
-        castArgs.push_back(new BitCastInst{ &*spFArgIt, ty, "", BB });
-      } else {
-        auto bc =
-            new BitCastInst{ &*spFArgIt, PointerType::getUnqual(ty), "", BB };
-        castArgs.push_back(new LoadInst{ bc, "", BB });
-      }
+      Value *idx[] = { ConstantInt::get(int32Ty, 0u),
+                       ConstantInt::get(int32Ty, i) };
+      auto gep = GetElementPtrInst::Create(frame, idx, "", BB);
+      frameArgs.push_back(new LoadInst{ gep, "", BB });
     }
-    
+
     // call F
-    auto call = CallInst::Create(F, castArgs, "", BB);
+    auto call = CallInst::Create(F, frameArgs, "", BB);
 
     if (returnsVal) {
       DEBUG(dbgs() << "Dealing with return of type ");
       DEBUG(F->getReturnType()->print(dbgs()));
       DEBUG(dbgs() << "\n");
 
-      auto bc = new BitCastInst{
-        &spFArgList.back(), PointerType::getUnqual(F->getReturnType()), "", BB
-      };
-      new StoreInst{ call, bc, BB };
+      Value *idx[] = { ConstantInt::get(int32Ty, 0u),
+                       ConstantInt::get(int32Ty, fields.size() - 1u) };
+      auto gep = GetElementPtrInst::Create(frame, idx, "", BB);
+      new StoreInst{ call, gep, BB };
     }
 
     ReturnInst::Create(c, nullptr, BB); // ret void
 
-    addSpawnableFun(F, spF);
+    addSpawnableFun(F, spF, frameTy);
     ++NumSpawnable;
   }
   return !functions.empty();
@@ -110,6 +114,7 @@ bool MakeSpawnable::runOnModule(Module &M) {
 
 void MakeSpawnable::releaseMemory() {
   funsToSpawnableFuns.clear();
+  funsToFrameTypes.clear();
   spawnableFuns.clear();
 }
 
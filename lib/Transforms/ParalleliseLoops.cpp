@@ -0,0 +1,1349 @@
+#define DEBUG_TYPE "parallelise-loops"
+
+// STL includes
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <vector>
+
+// hydra includes
+#include "hydra/Analyses/Decider.h"
+#include "hydra/Analyses/Fitness.h"
+#include "hydra/Analyses/Profitability.h"
+#include "hydra/Support/FunAlgorithms.h"
+#include "hydra/Support/Target.h"
+
+// llvm includes
+#include "llvm/Pass.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/Analysis/DependenceAnalysis.h"
+#include "llvm/Analysis/Dominators.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/ScalarEvolution.h"
+#include "llvm/Analysis/ScalarEvolutionExpander.h"
+#include "llvm/Analysis/ScalarEvolutionExpressions.h"
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/DerivedTypes.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Operator.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Debug.h"
+#include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/ValueHandle.h"
+#include "llvm/Transforms/Utils/CodeExtractor.h"
+#include "llvm/Transforms/Utils/Local.h"
+#include "llvm/Transforms/Utils/ValueMapper.h"
+
+STATISTIC(NumLoopsParallelised, "Number of loops parallelised");
+STATISTIC(NumLoopsDeferred, "Number of loops whose calls' joins were deferred");
+
+using namespace llvm;
+using namespace hydra;
+
+static cl::opt<unsigned>
+LoopChunks("loop-chunks",
+           cl::desc("Most chunks a parallelised loop is split into, which "
+                    "should be a few per worker so that they balance out"),
+           cl::init(32u));
+
+static cl::opt<unsigned>
+DeferWindow("defer-window",
+            cl::desc("Most iterations of a loop whose calls are spawned "
+                     "before they're joined and the rest of those iterations "
+                     "run"),
+            cl::init(1024u));
+
+// a chunk is only spawned if it does at least this many times the work a
+// spawn costs
+static constexpr unsigned chunkWorkFactor = 10u;
+
+namespace {
+  // an accumulator which each iteration of a loop folds a value into with an
+  // associative and commutative operation, so chunks of iterations can fold
+  // into accumulators of their own which are combined afterwards
+  struct Reduction {
+    enum Kind { Add, Mul, And, Or, Xor, FAdd, FMul, SMin, SMax, UMin, UMax };
+    PHINode *phi;      // the accumulator, in the loop's header
+    Instruction *next; // its value at the end of an iteration
+    Kind kind;
+  };
+
+  // spawns the iterations of every loop whose iterations are independent (a
+  // DOALL loop) as one range, which the runtime splits up, or as chunks if it
+  // has reductions, into a sync group which is joined where the loop exits.
+  // Of the loops left, each one which makes
+  // functional calls from arguments that don't depend on earlier iterations
+  // spawns a window of iterations' calls, joins them all, then runs the rest
+  // of those iterations with the calls' results.
+  class ParalleliseLoops : public ModulePass {
+  public:
+    static char ID;
+    ParalleliseLoops();
+    virtual void getAnalysisUsage(AnalysisUsage &Info) const override;
+    virtual bool runOnModule(Module &M) override;
+  private:
+    void declareRuntime(Module &M);
+    bool paralleliseOneLoop(Function &F);
+    Loop *findDOALLLoop(Loop *L, ScalarEvolution &SE, DependenceAnalysis &DA,
+                        DominatorTree &DT) const;
+    bool isDOALL(Loop *L, ScalarEvolution &SE, DependenceAnalysis &DA) const;
+    unsigned iterationCost(const Loop &L, LoopInfo &LI,
+                           ScalarEvolution &SE) const;
+    void spawnRange(CallInst *call, unsigned loIdx, unsigned hiIdx,
+                    uint64_t minChunk);
+    void spawnChunks(CallInst *call, unsigned loIdx, unsigned hiIdx,
+                     uint64_t minChunk,
+                     const std::vector<std::pair<unsigned, Reduction::Kind> >
+                         &partials);
+    bool deferOneLoop(Function &F);
+    PHINode *findDeferrableCalls(Loop *L, LoopInfo &LI, ScalarEvolution &SE,
+                                 DominatorTree &DT,
+                                 std::vector<CallInst *> &calls) const;
+    Function *getSpawnableFun(Function *F, const Twine &prefix,
+                              StructType *&frameTy);
+    std::map<Function *, std::pair<Function *, StructType *> > spawnableFuns;
+    StructType *groupTy;
+    Constant *groupSpawn;
+    Constant *localGroupSpawn;
+    Constant *rangeSpawn;
+    Constant *groupJoin;
+  };
+}
+
+char ParalleliseLoops::ID = 0;
+
+//------------------------------------------------------------------------------
+ParalleliseLoops::ParalleliseLoops() : ModulePass { ID } {}
+
+//------------------------------------------------------------------------------
+void ParalleliseLoops::getAnalysisUsage(AnalysisUsage &Info) const {
+  Info.addRequired<Fitness>();
+  Info.addRequired<Profitability>();
+  Info.addRequired<DominatorTree>();
+  Info.addRequired<LoopInfo>();
+  Info.addRequired<ScalarEvolution>();
+  Info.addRequired<DependenceAnalysis>();
+}
+
+//------------------------------------------------------------------------------
+bool ParalleliseLoops::runOnModule(Module &M) {
+  DEBUG(dbgs() << "ParalleliseLoops::runOnModule()\n");
+
+  // chunks are spawned into a sync group, which kernel threads don't have
+  if (!hasTaskHandles()) {
+    DEBUG(dbgs() << "Early exit: the target can't group spawns.\n");
+    return false;
+  }
+
+  declareRuntime(M);
+
+  // the functions which loops are extracted into aren't looked at again
+  std::vector<Function *> functions;
+  for (auto &F : M) {
+    if (!F.isDeclaration()) {
+      functions.push_back(&F);
+    }
+  }
+
+  bool changed{ false };
+  for (auto *F : functions) {
+    // each loop parallelised leaves F, so this runs out of loops eventually
+    while (paralleliseOneLoop(*F)) {
+      ++NumLoopsParallelised;
+      changed = true;
+    }
+    // and each loop whose calls are deferred no longer makes them
+    while (deferOneLoop(*F)) {
+      ++NumLoopsDeferred;
+      changed = true;
+    }
+  }
+  return changed;
+}
+
+//------------------------------------------------------------------------------
+// declare the group spawns, range spawn and join, as Hello does
+void ParalleliseLoops::declareRuntime(Module &M) {
+  LLVMContext &c{ M.getContext() };
+
+  groupTy = M.getTypeByName("struct.hydra_group");
+  if (!groupTy) {
+    Type *ts[1] = { Type::getInt32Ty(c) };
+    groupTy = StructType::create(c, ts, "struct.hydra_group");
+  }
+
+  Type *voidStarTy{ PointerType::getUnqual(Type::getInt8Ty(c)) };
+  Type *fTs[1] = { voidStarTy };
+  Type *fTy{ PointerType::getUnqual(
+      FunctionType::get(Type::getVoidTy(c), fTs, false)) };
+
+  const bool shim{ getTarget() == Target::Shim };
+  Type *spawnSig[] = { PointerType::getUnqual(groupTy), fTy, voidStarTy,
+                       Type::getInt64Ty(c) };
+  groupSpawn = M.getOrInsertFunction(
+      shim ? "hydra_group_spawn" : "_Z5spawnP11hydra_groupPFvPvES1_m",
+      FunctionType::get(Type::getVoidTy(c), spawnSig, false));
+
+  // a frame holding pointers into this process is spawned without its size,
+  // which the process and remote pools take to mean it must be run here; the
+  // shim takes a size of 0 to mean the same
+  Type *localSpawnSig[] = { PointerType::getUnqual(groupTy), fTy, voidStarTy };
+  localGroupSpawn =
+      shim ? groupSpawn
+           : M.getOrInsertFunction(
+                 "_Z5spawnP11hydra_groupPFvPvES1_",
+                 FunctionType::get(Type::getVoidTy(c), localSpawnSig, false));
+
+  Type *i64Ty{ Type::getInt64Ty(c) };
+  Type *bodyTs[] = { voidStarTy, i64Ty, i64Ty };
+  Type *bodyTy{ PointerType::getUnqual(
+      FunctionType::get(Type::getVoidTy(c), bodyTs, false)) };
+  Type *rangeSig[] = { PointerType::getUnqual(groupTy), bodyTy, voidStarTy,
+                       i64Ty, i64Ty, i64Ty };
+  rangeSpawn = M.getOrInsertFunction(
+      shim ? "hydra_spawn_range"
+           : "_Z11spawn_rangeP11hydra_groupPFvPvmmES1_mmm",
+      FunctionType::get(Type::getVoidTy(c), rangeSig, false));
+
+  Type *joinSig[] = { PointerType::getUnqual(groupTy) };
+  groupJoin = M.getOrInsertFunction(
+      shim ? "hydra_group_join" : "_Z4joinP11hydra_group",
+      FunctionType::get(Type::getVoidTy(c), joinSig, false));
+}
+
+//------------------------------------------------------------------------------
+// returns true, filling in red, if phi is a reduction in L: updated once per
+// iteration, and seen by nothing but that update until the loop exits
+static bool matchReduction(PHINode *phi, Loop *L, Reduction &red) {
+  if (!phi->getType()->isIntegerTy() && !phi->getType()->isFloatingPointTy()) {
+    return false;
+  }
+  auto *next = dyn_cast<Instruction>(
+      phi->getIncomingValueForBlock(L->getLoopLatch()));
+  if (!next || !L->contains(next->getParent())) {
+    return false;
+  }
+
+  Instruction *cmp{ nullptr };
+  if (auto *op = dyn_cast<BinaryOperator>(next)) {
+    if ((op->getOperand(0) == phi) == (op->getOperand(1) == phi)) {
+      return false;
+    }
+    switch (op->getOpcode()) {
+    case Instruction::Add: red.kind = Reduction::Add; break;
+    case Instruction::Mul: red.kind = Reduction::Mul; break;
+    case Instruction::And: red.kind = Reduction::And; break;
+    case Instruction::Or: red.kind = Reduction::Or; break;
+    case Instruction::Xor: red.kind = Reduction::Xor; break;
+    case Instruction::FAdd: red.kind = Reduction::FAdd; break;
+    case Instruction::FMul: red.kind = Reduction::FMul; break;
+    default: return false;
+    }
+    // floating point may only be reassociated under fast-math
+    if (op->getType()->isFloatingPointTy() && !op->hasUnsafeAlgebra()) {
+      return false;
+    }
+  } else if (auto *sel = dyn_cast<SelectInst>(next)) {
+    // min or max: select(a < b, a, b), with phi as a or b
+    auto *icmp = dyn_cast<ICmpInst>(sel->getCondition());
+    Value *a{ sel->getTrueValue() }, *b{ sel->getFalseValue() };
+    if (!icmp || !icmp->hasOneUse() || (a == phi) == (b == phi)) {
+      return false;
+    }
+    ICmpInst::Predicate pred{ icmp->getPredicate() };
+    if (icmp->getOperand(0) == b && icmp->getOperand(1) == a) {
+      pred = icmp->getSwappedPredicate();
+    } else if (icmp->getOperand(0) != a || icmp->getOperand(1) != b) {
+      return false;
+    }
+    switch (pred) {
+    case ICmpInst::ICMP_SLT: case ICmpInst::ICMP_SLE:
+      red.kind = Reduction::SMin; break;
+    case ICmpInst::ICMP_SGT: case ICmpInst::ICMP_SGE:
+      red.kind = Reduction::SMax; break;
+    case ICmpInst::ICMP_ULT: case ICmpInst::ICMP_ULE:
+      red.kind = Reduction::UMin; break;
+    case ICmpInst::ICMP_UGT: case ICmpInst::ICMP_UGE:
+      red.kind = Reduction::UMax; break;
+    default: return false;
+    }
+    cmp = icmp;
+  } else {
+    return false;
+  }
+
+  for (auto it = phi->use_begin(), e = phi->use_end(); it != e; ++it) {
+    if (*it != next && *it != cmp) {
+      return false;
+    }
+  }
+  for (auto it = next->use_begin(), e = next->use_end(); it != e; ++it) {
+    if (*it != phi && L->contains(cast<Instruction>(*it)->getParent())) {
+      return false;
+    }
+  }
+
+  red.phi = phi;
+  red.next = next;
+  return true;
+}
+
+//------------------------------------------------------------------------------
+// returns true if phi steps by the same amount in each iteration of L, so it
+// can be worked out from the number of iterations run so far
+static bool isInductionVariable(PHINode *phi, Loop *L, ScalarEvolution &SE) {
+  const auto *expr = dyn_cast<SCEVAddRecExpr>(SE.getSCEV(phi));
+  return expr && expr->getLoop() == L && expr->isAffine() &&
+         phi->getType()->isIntegerTy() &&
+         phi->getType()->getIntegerBitWidth() <= 64u;
+}
+
+//------------------------------------------------------------------------------
+// returns L's induction variable, filling in the reductions which are its
+// other header phis; nullptr if there isn't exactly one integer induction
+// variable, or a phi is neither
+static PHINode *classifyPHIs(Loop *L, ScalarEvolution &SE,
+                             std::vector<Reduction> &reductions) {
+  PHINode *iv{ nullptr };
+  for (auto &I : *L->getHeader()) {
+    auto *phi = dyn_cast<PHINode>(&I);
+    if (!phi) {
+      break;
+    }
+    Reduction red;
+    if (matchReduction(phi, L, red)) {
+      reductions.push_back(red);
+    } else if (iv) {
+      return nullptr;
+    } else {
+      iv = phi;
+    }
+  }
+
+  return iv && isInductionVariable(iv, L, SE) ? iv : nullptr;
+}
+
+//------------------------------------------------------------------------------
+// returns true if L has the shape whose iterations can be counted: a single
+// exit, from its latch, after a number of iterations known on entry. The exit
+// must be reached from the latch alone, as the transforms rewrite its phis
+// for the latch's edge, and a guard branching around L would skip them.
+static bool hasCountableShape(Loop *L, ScalarEvolution &SE) {
+  BasicBlock *latch{ L->getLoopLatch() };
+  if (!L->getLoopPreheader() || !latch || !L->getExitBlock() ||
+      L->getExitingBlock() != latch) {
+    DEBUG(dbgs() << "Not in simplified form, or has several exits.\n");
+    return false;
+  }
+  if (!L->hasDedicatedExits() ||
+      L->getExitBlock()->getSinglePredecessor() != latch) {
+    DEBUG(dbgs() << "The exit is reached from outside the loop too.\n");
+    return false;
+  }
+
+  auto *br = dyn_cast<BranchInst>(latch->getTerminator());
+  if (!br || !br->isConditional()) {
+    return false;
+  }
+
+  const SCEV *backedges{ SE.getBackedgeTakenCount(L) };
+  if (isa<SCEVCouldNotCompute>(backedges) ||
+      SE.getTypeSizeInBits(backedges->getType()) > 64u) {
+    DEBUG(dbgs() << "The trip count isn't known on entry.\n");
+    return false;
+  }
+  return true;
+}
+
+//------------------------------------------------------------------------------
+// expand, in L's preheader, where its induction variable iv starts and how
+// far it steps, and how many iterations L runs (as an i64)
+static void expandBounds(Loop *L, PHINode *iv, ScalarEvolution &SE,
+                         Value *&start, Value *&step, Value *&tripCount) {
+  Instruction *insertPt{ L->getLoopPreheader()->getTerminator() };
+  const auto *ivExpr = cast<SCEVAddRecExpr>(SE.getSCEV(iv));
+  Type *ivTy{ iv->getType() };
+  const SCEV *backedges{ SE.getBackedgeTakenCount(L) };
+  SCEVExpander expander{ SE, "loop" };
+  start = expander.expandCodeFor(ivExpr->getStart(), ivTy, insertPt);
+  step = expander.expandCodeFor(ivExpr->getStepRecurrence(SE), ivTy,
+                                insertPt);
+  Type *i64Ty{ Type::getInt64Ty(L->getHeader()->getContext()) };
+  tripCount = BinaryOperator::CreateAdd(
+      CastInst::CreateZExtOrBitCast(
+          expander.expandCodeFor(backedges, backedges->getType(), insertPt),
+          i64Ty, "", insertPt),
+      ConstantInt::get(i64Ty, 1u), "trip.count", insertPt);
+}
+
+//------------------------------------------------------------------------------
+// make L count iterations lo to hi on a new i64 counter, which starts at lo
+// on entry from entry, and from which iv is worked out as start + step *
+// counter; L then exits once the counter reaches hi, rather than on its old
+// condition. Returns the counter.
+static PHINode *countIterations(Loop *L, PHINode *iv, Value *start,
+                                Value *step, Value *lo, Value *hi,
+                                BasicBlock *entry) {
+  BasicBlock *header{ L->getHeader() };
+  BasicBlock *latch{ L->getLoopLatch() };
+  Type *i64Ty{ lo->getType() };
+
+  auto *k = PHINode::Create(i64Ty, 2u, "k", &header->front());
+  auto *kNext = BinaryOperator::CreateAdd(k, ConstantInt::get(i64Ty, 1u),
+                                          "k.next", latch->getTerminator());
+  k->addIncoming(lo, entry);
+  k->addIncoming(kNext, latch);
+
+  Instruction *ivInsertPt{ &*header->getFirstInsertionPt() };
+  auto *kCast =
+      CastInst::CreateIntegerCast(k, iv->getType(), false, "", ivInsertPt);
+  auto *newIV = BinaryOperator::CreateAdd(
+      start, BinaryOperator::CreateMul(step, kCast, "", ivInsertPt), "iv",
+      ivInsertPt);
+  WeakVH oldNext{ iv->getIncomingValueForBlock(latch) };
+  iv->replaceAllUsesWith(newIV);
+  iv->eraseFromParent();
+
+  auto *oldBr = cast<BranchInst>(latch->getTerminator());
+  WeakVH oldCond{ oldBr->getCondition() };
+  auto *more = new ICmpInst(oldBr, ICmpInst::ICMP_ULT, kNext, hi, "k.more");
+  BranchInst::Create(header, L->getExitBlock(), more, oldBr);
+  oldBr->eraseFromParent();
+  if (oldCond) {
+    RecursivelyDeleteTriviallyDeadInstructions(oldCond);
+  }
+  if (oldNext) {
+    RecursivelyDeleteTriviallyDeadInstructions(oldNext);
+  }
+  return k;
+}
+
+//------------------------------------------------------------------------------
+// returns true if v can be worked out in any iteration of L without running
+// the ones before it: from iv and values from outside L, by instructions
+// which are safe to run early and don't read memory. Adds the instructions in
+// L which it takes to slice, each after those it uses.
+static bool isIterationIndependent(Value *v, Loop *L, PHINode *iv,
+                                   std::vector<Instruction *> &slice) {
+  auto *I = dyn_cast<Instruction>(v);
+  if (!I || I == iv || !L->contains(I->getParent()) ||
+      std::find(slice.begin(), slice.end(), I) != slice.end()) {
+    return true;
+  }
+  // a load is safe to speculate whenever its pointer is dereferenceable, but
+  // run ahead of the iterations before it, it may miss what they store
+  if (isa<PHINode>(I) || I->mayReadFromMemory() ||
+      !isSafeToSpeculativelyExecute(I)) {
+    return false;
+  }
+  for (unsigned i = 0u, e = I->getNumOperands(); i < e; ++i) {
+    if (!isIterationIndependent(I->getOperand(i), L, iv, slice)) {
+      return false;
+    }
+  }
+  slice.push_back(I);
+  return true;
+}
+
+//------------------------------------------------------------------------------
+// the value a reduction of this kind starts from in each chunk
+static Constant *identityOf(const Reduction::Kind kind, Type *ty) {
+  switch (kind) {
+  case Reduction::Add: case Reduction::Or: case Reduction::Xor:
+  case Reduction::UMax:
+    return Constant::getNullValue(ty);
+  case Reduction::Mul:
+    return ConstantInt::get(ty, 1u);
+  case Reduction::And: case Reduction::UMin:
+    return Constant::getAllOnesValue(ty);
+  case Reduction::FAdd:
+    return ConstantFP::getNegativeZero(ty);
+  case Reduction::FMul:
+    return ConstantFP::get(ty, 1.0);
+  case Reduction::SMin:
+    return ConstantInt::get(
+        ty->getContext(), APInt::getSignedMaxValue(ty->getIntegerBitWidth()));
+  case Reduction::SMax:
+    return ConstantInt::get(
+        ty->getContext(), APInt::getSignedMinValue(ty->getIntegerBitWidth()));
+  }
+  llvm_unreachable("Unknown kind of reduction!");
+}
+
+//------------------------------------------------------------------------------
+// fold a and b together before insertPt, as a reduction of this kind does.
+// The fold carries no nsw, nuw or exact flags: the partial results it joins
+// are regrouped, and may overflow where the loop run in order wouldn't.
+static Value *combine(const Reduction::Kind kind, Value *a, Value *b,
+                      Instruction *insertPt) {
+  ICmpInst::Predicate pred{ ICmpInst::ICMP_SLT };
+  switch (kind) {
+  case Reduction::Add: return BinaryOperator::CreateAdd(a, b, "", insertPt);
+  case Reduction::Mul: return BinaryOperator::CreateMul(a, b, "", insertPt);
+  case Reduction::And: return BinaryOperator::CreateAnd(a, b, "", insertPt);
+  case Reduction::Or: return BinaryOperator::CreateOr(a, b, "", insertPt);
+  case Reduction::Xor: return BinaryOperator::CreateXor(a, b, "", insertPt);
+  case Reduction::FAdd:
+  case Reduction::FMul: {
+    auto *op = BinaryOperator::Create(kind == Reduction::FAdd
+                                          ? Instruction::FAdd
+                                          : Instruction::FMul,
+                                      a, b, "", insertPt);
+    op->setHasUnsafeAlgebra(true);
+    return op;
+  }
+  case Reduction::SMin: pred = ICmpInst::ICMP_SLT; break;
+  case Reduction::SMax: pred = ICmpInst::ICMP_SGT; break;
+  case Reduction::UMin: pred = ICmpInst::ICMP_ULT; break;
+  case Reduction::UMax: pred = ICmpInst::ICMP_UGT; break;
+  }
+  auto *cmp = new ICmpInst(insertPt, pred, a, b, "");
+  return SelectInst::Create(cmp, a, b, "", insertPt);
+}
+
+//------------------------------------------------------------------------------
+// returns L, or the first loop nested in it, if its iterations may run in
+// parallel and it can be extracted into a function of its own
+Loop *ParalleliseLoops::findDOALLLoop(Loop *L, ScalarEvolution &SE,
+                                      DependenceAnalysis &DA,
+                                      DominatorTree &DT) const {
+  if (isDOALL(L, SE, DA) && CodeExtractor{ DT, *L }.isEligible()) {
+    return L;
+  }
+  for (auto *subLoop : *L) {
+    if (Loop *found = findDOALLLoop(subLoop, SE, DA, DT)) {
+      return found;
+    }
+  }
+  return nullptr;
+}
+
+//------------------------------------------------------------------------------
+// returns true if no iteration of L depends on another, and L has the shape
+// paralleliseOneLoop can rewrite: one induction variable counting a number of
+// iterations known on entry, and a single exit from its latch
+bool ParalleliseLoops::isDOALL(Loop *L, ScalarEvolution &SE,
+                               DependenceAnalysis &DA) const {
+  DEBUG(dbgs() << "ParalleliseLoops::isDOALL() for loop at "
+               << L->getHeader()->getName() << "\n");
+
+  if (!hasCountableShape(L, SE)) {
+    return false;
+  }
+
+  // any phi other than the induction variable carries a value from one
+  // iteration to the next, and only a reduction's can be split between chunks
+  std::vector<Reduction> reductions;
+  if (!classifyPHIs(L, SE, reductions)) {
+    DEBUG(dbgs() << "The header's phis aren't an integer induction variable "
+                    "and reductions.\n");
+    return false;
+  }
+
+  auto &Fit = getAnalysis<Fitness>();
+  std::vector<Instruction *> memAccesses;
+  for (auto *BB : L->getBlocks()) {
+    for (auto &I : *BB) {
+      // a value used after the loop would have to come from its last chunk,
+      // unless it's a reduction's, which combines every chunk's
+      const bool reduced{ std::any_of(reductions.begin(), reductions.end(),
+                                      [&](const Reduction &red) {
+        return red.next == &I;
+      }) };
+      for (auto it = I.use_begin(), e = I.use_end(); !reduced && it != e;
+           ++it) {
+        if (!L->contains(cast<Instruction>(*it)->getParent())) {
+          DEBUG(dbgs() << "A value is used after the loop.\n");
+          return false;
+        }
+      }
+
+      if (auto *ci = dyn_cast<CallInst>(&I)) {
+        const Function *callee{ ci->getCalledFunction() };
+        if (!ci->doesNotAccessMemory() && !isa<DbgInfoIntrinsic>(ci) &&
+            !(callee && Fit.isFunctional(*callee))) {
+          DEBUG(dbgs() << "The loop makes a call with side effects.\n");
+          return false;
+        }
+      } else if (auto *load = dyn_cast<LoadInst>(&I)) {
+        if (!load->isSimple()) {
+          return false;
+        }
+        memAccesses.push_back(load);
+      } else if (auto *store = dyn_cast<StoreInst>(&I)) {
+        if (!store->isSimple()) {
+          return false;
+        }
+        memAccesses.push_back(store);
+      } else if (I.mayReadOrWriteMemory() || isa<InvokeInst>(I)) {
+        return false;
+      }
+    }
+  }
+
+  // a dependence between two accesses, at least one of them a store, which
+  // isn't between accesses in the same iteration of L is carried by L
+  const unsigned level{ L->getLoopDepth() };
+  for (auto *src : memAccesses) {
+    for (auto *dst : memAccesses) {
+      if (!isa<StoreInst>(src) && !isa<StoreInst>(dst)) {
+        continue;
+      }
+      std::unique_ptr<Dependence> dep{ DA.depends(src, dst, true) };
+      if (dep && (dep->isConfused() ||
+                  dep->getDirection(level) != Dependence::DVEntry::EQ)) {
+        DEBUG(dbgs() << "Loop-carried dependence between:\n");
+        DEBUG(src->print(dbgs()));
+        DEBUG(dbgs() << "\n");
+        DEBUG(dst->print(dbgs()));
+        DEBUG(dbgs() << "\n");
+        return false;
+      }
+    }
+  }
+
+  return true;
+}
+
+//------------------------------------------------------------------------------
+// the instructions one iteration of L takes, counting the calls it makes at
+// their callees' totalCost, and any nested loop at its trip count if known
+unsigned ParalleliseLoops::iterationCost(const Loop &L, LoopInfo &LI,
+                                         ScalarEvolution &SE) const {
+  const auto &Profit = getAnalysis<Profitability>();
+
+  unsigned cost{ 0u };
+  for (auto *BB : L.getBlocks()) {
+    unsigned bbCost{ 0u };
+    for (auto &I : *BB) {
+      if (isEmittingInst(I)) {
+        ++bbCost;
+      }
+      if (auto *ci = dyn_cast<CallInst>(&I)) {
+        const Function *callee{ ci->getCalledFunction() };
+        if (const auto *funStats = callee ? Profit.getFunStats(*callee)
+                                          : nullptr) {
+          bbCost += funStats->totalCost;
+        }
+      }
+    }
+
+    Loop *inner{ LI.getLoopFor(BB) };
+    if (inner != &L) {
+      if (const unsigned tripCount = SE.getSmallConstantTripCount(inner,
+                                                                  nullptr)) {
+        bbCost *= tripCount;
+      }
+    }
+    cost += bbCost;
+  }
+  return std::max(cost, 1u);
+}
+
+//------------------------------------------------------------------------------
+// find a DOALL loop in F and parallelise it; returns false if there were none
+bool ParalleliseLoops::paralleliseOneLoop(Function &F) {
+  DEBUG(dbgs() << "ParalleliseLoops::paralleliseOneLoop() for " << F.getName()
+               << "()\n");
+
+  // each of these reruns the function passes on F, so they see F as it is now
+  auto &LI = getAnalysis<LoopInfo>(F);
+  auto &SE = getAnalysis<ScalarEvolution>(F);
+  auto &DT = getAnalysis<DominatorTree>(F);
+  auto &DA = getAnalysis<DependenceAnalysis>(F);
+
+  Loop *L{ nullptr };
+  for (auto *topLoop : LI) {
+    if ((L = findDOALLLoop(topLoop, SE, DA, DT))) {
+      break;
+    }
+  }
+  if (!L) {
+    return false;
+  }
+
+  const unsigned cost{ iterationCost(*L, LI, SE) };
+  const uint64_t minChunk{ std::max<uint64_t>(
+      1u, (uint64_t{ chunkWorkFactor } * getSpawnCost() + cost - 1u) / cost) };
+  DEBUG(dbgs() << "Each iteration costs " << cost
+               << ", so chunks have at least " << minChunk << " iterations\n");
+
+  BasicBlock *preheader{ L->getLoopPreheader() };
+  BasicBlock *latch{ L->getLoopLatch() };
+
+  // work out the trip count, and where the induction variable starts and how
+  // far it steps, before the loop is entered
+  std::vector<Reduction> reductions;
+  PHINode *iv{ classifyPHIs(L, SE, reductions) };
+  Value *start, *step, *hi;
+  expandBounds(L, iv, SE, start, step, hi);
+
+  // always 0, but kept out of the loop so that it becomes an argument of the
+  // extracted function, which can then run any range of iterations
+  Value *lo{ BinaryOperator::CreateSub(hi, hi, "chunk.begin",
+                                       preheader->getTerminator()) };
+  countIterations(L, iv, start, step, lo, hi, preheader);
+
+  // each chunk folds its iterations into an accumulator of its own, starting
+  // from the identity, and leaves it in an output of the extracted function.
+  // The exit then sees the accumulator's initial value combined with the
+  // outputs, which spawnChunks combines for every chunk.
+  BasicBlock *exit{ L->getExitBlock() };
+  std::vector<PHINode *> outs;
+  std::vector<Reduction::Kind> kinds;
+  for (auto &red : reductions) {
+    std::vector<Instruction *> users;
+    for (auto it = red.next->use_begin(), e = red.next->use_end(); it != e;
+         ++it) {
+      if (!L->contains(cast<Instruction>(*it)->getParent())) {
+        users.push_back(cast<Instruction>(*it));
+      }
+    }
+    if (users.empty()) {
+      continue;
+    }
+
+    const int fromPreheader{ red.phi->getBasicBlockIndex(preheader) };
+    Value *init{ red.phi->getIncomingValue(fromPreheader) };
+    red.phi->setIncomingValue(fromPreheader,
+                              identityOf(red.kind, red.phi->getType()));
+
+    // a chunk's accumulator sums a different subset of the iterations, which
+    // may overflow where the whole loop's wouldn't, so it mustn't be poison
+    if (auto *op = dyn_cast<BinaryOperator>(red.next)) {
+      if (isa<OverflowingBinaryOperator>(op)) {
+        op->setHasNoSignedWrap(false);
+        op->setHasNoUnsignedWrap(false);
+      }
+      if (isa<PossiblyExactOperator>(op)) {
+        op->setIsExact(false);
+      }
+    }
+
+    auto *out = PHINode::Create(red.phi->getType(), 1u, "partial",
+                                &exit->front());
+    Value *total{ combine(red.kind, init, out,
+                          &*exit->getFirstInsertionPt()) };
+    for (auto *user : users) {
+      // the exit's only predecessor is the latch (see hasCountableShape), so
+      // its phis can go
+      if (isa<PHINode>(user) && user->getParent() == exit) {
+        user->replaceAllUsesWith(total);
+        user->eraseFromParent();
+      } else {
+        user->replaceUsesOfWith(red.next, total);
+      }
+    }
+    out->addIncoming(red.next, latch);
+    outs.push_back(out);
+    kinds.push_back(red.kind);
+  }
+
+  // the CFG is as it was, so the dominator tree is still valid
+  Function *loopFun{ CodeExtractor{ DT, *L }.extractCodeRegion() };
+  assert(loopFun && "Extraction failed after checking eligibility!");
+  auto *call = cast<CallInst>(*loopFun->use_begin());
+
+  unsigned loIdx{ 0u }, hiIdx{ 0u };
+  for (unsigned i = 0u, e = call->getNumArgOperands(); i < e; ++i) {
+    if (call->getArgOperand(i) == lo) {
+      loIdx = i;
+    } else if (call->getArgOperand(i) == hi) {
+      hiIdx = i;
+    }
+  }
+  assert(call->getArgOperand(loIdx) == lo && call->getArgOperand(hiIdx) == hi &&
+         "The loop's bounds aren't arguments of the extracted function!");
+
+  // CodeExtractor reloads each output from an alloca it passes to the call
+  std::vector<std::pair<unsigned, Reduction::Kind> > partials;
+  for (unsigned r = 0u, e = outs.size(); r < e; ++r) {
+    Value *slot{ cast<LoadInst>(outs[r]->getIncomingValue(0u))
+                     ->getPointerOperand() };
+    for (unsigned i = 0u, n = call->getNumArgOperands(); i < n; ++i) {
+      if (call->getArgOperand(i) == slot) {
+        partials.emplace_back(i, kinds[r]);
+      }
+    }
+  }
+  assert(partials.size() == outs.size() &&
+         "A reduction isn't an output of the extracted function!");
+
+  // without reductions, every iteration can share one frame, and the runtime
+  // splits the range up as workers come looking for work
+  if (partials.empty()) {
+    spawnRange(call, loIdx, hiIdx, minChunk);
+  } else {
+    spawnChunks(call, loIdx, hiIdx, minChunk, partials);
+  }
+  return true;
+}
+
+//------------------------------------------------------------------------------
+// returns a spawnable function, named prefix + F's name, which calls F with
+// its arguments packed into a frame followed by its return value if it has
+// one, as MakeSpawnable does; it's only created the first time it's needed
+Function *ParalleliseLoops::getSpawnableFun(Function *F, const Twine &prefix,
+                                            StructType *&frameTy) {
+  auto it = spawnableFuns.find(F);
+  if (it != spawnableFuns.end()) {
+    frameTy = it->second.second;
+    return it->second.first;
+  }
+
+  Module *M{ F->getParent() };
+  LLVMContext &c{ M->getContext() };
+  const bool returnsVal{ !F->getReturnType()->isVoidTy() };
+
+  std::vector<Type *> fields;
+  for (auto &arg : F->getArgumentList()) {
+    fields.push_back(arg.getType());
+  }
+  const unsigned numArgs{ static_cast<unsigned>(fields.size()) };
+  if (returnsVal) {
+    fields.push_back(F->getReturnType());
+  }
+  frameTy = StructType::create(c, fields, ("_Frame_" + F->getName()).str());
+
+  Type *const voidStarTy{ PointerType::getUnqual(Type::getInt8Ty(c)) };
+  Type *ts[1] = { voidStarTy };
+  FunctionType *fTy{ FunctionType::get(Type::getVoidTy(c), ts, false) };
+  Function *spF{ Function::Create(fTy, Function::InternalLinkage,
+                                  prefix + F->getName(), M) };
+
+  BasicBlock *BB{ BasicBlock::Create(c, "entry", spF) };
+  auto *frame = new BitCastInst{ &spF->getArgumentList().front(),
+                                 PointerType::getUnqual(frameTy), "frame",
+                                 BB };
+
+  Type *const int32Ty{ Type::getInt32Ty(c) };
+  std::vector<Value *> args;
+  for (unsigned i{ 0u }; i < numArgs; ++i) {
+    Value *idx[] = { ConstantInt::get(int32Ty, 0u),
+                     ConstantInt::get(int32Ty, i) };
+    auto gep = GetElementPtrInst::Create(frame, idx, "", BB);
+    args.push_back(new LoadInst{ gep, "", BB });
+  }
+  auto *call = CallInst::Create(F, args, "", BB);
+  if (returnsVal) {
+    Value *idx[] = { ConstantInt::get(int32Ty, 0u),
+                     ConstantInt::get(int32Ty, numArgs) };
+    new StoreInst{ call, GetElementPtrInst::Create(frame, idx, "", BB), BB };
+  }
+  ReturnInst::Create(c, nullptr, BB);
+
+  spawnableFuns[F] = std::make_pair(spF, frameTy);
+  return spF;
+}
+
+//------------------------------------------------------------------------------
+// replace call, which runs the extracted loop from its loIdx-th argument to
+// its hiIdx-th, with a range spawn of those iterations into a group, joined
+// before carrying on. The runtime splits the range into pieces of at least
+// minChunk iterations, each run by a function which reads call's other
+// arguments from one shared frame. A loop with no more than minChunk
+// iterations is run here, as it was.
+void ParalleliseLoops::spawnRange(CallInst *call, const unsigned loIdx,
+                                  const unsigned hiIdx,
+                                  const uint64_t minChunk) {
+  DEBUG(dbgs() << "ParalleliseLoops::spawnRange()\n");
+
+  BasicBlock *BB{ call->getParent() };
+  Function *F{ BB->getParent() };
+  Function *loopFun{ call->getCalledFunction() };
+  LLVMContext &c{ F->getContext() };
+  Type *i64Ty{ Type::getInt64Ty(c) };
+  Type *int32Ty{ Type::getInt32Ty(c) };
+  Type *voidStarTy{ PointerType::getUnqual(Type::getInt8Ty(c)) };
+
+  std::vector<Type *> fields;
+  for (auto &arg : loopFun->getArgumentList()) {
+    fields.push_back(arg.getType());
+  }
+  StructType *frameTy{ StructType::create(
+      c, fields, ("_Frame_" + loopFun->getName()).str()) };
+
+  // the body the runtime calls on each piece [lo, hi) of the range
+  Type *ts[] = { voidStarTy, i64Ty, i64Ty };
+  FunctionType *rangeTy{ FunctionType::get(Type::getVoidTy(c), ts, false) };
+  Function *rangeFun{ Function::Create(rangeTy, Function::InternalLinkage,
+                                       "_Range_" + loopFun->getName(),
+                                       F->getParent()) };
+  auto argIt = rangeFun->arg_begin();
+  Argument *frameArg{ &*argIt++ };
+  Argument *lo{ &*argIt++ };
+  Argument *hi{ &*argIt };
+  BasicBlock *rangeBB{ BasicBlock::Create(c, "entry", rangeFun) };
+  auto *rangeFrame = new BitCastInst{ frameArg,
+                                      PointerType::getUnqual(frameTy),
+                                      "frame", rangeBB };
+  std::vector<Value *> args;
+  for (unsigned i = 0u, e = fields.size(); i < e; ++i) {
+    if (i == loIdx) {
+      args.push_back(lo);
+    } else if (i == hiIdx) {
+      args.push_back(hi);
+    } else {
+      Value *idx[] = { ConstantInt::get(int32Ty, 0u),
+                       ConstantInt::get(int32Ty, i) };
+      auto gep = GetElementPtrInst::Create(rangeFrame, idx, "", rangeBB);
+      args.push_back(new LoadInst{ gep, "", rangeBB });
+    }
+  }
+  CallInst::Create(loopFun, args, "", rangeBB);
+  ReturnInst::Create(c, nullptr, rangeBB);
+
+  // the frame must outlive the join
+  Instruction *entryPt{ &*F->getEntryBlock().getFirstInsertionPt() };
+  auto *frame = new AllocaInst(frameTy, "frame", entryPt);
+  auto *group = new AllocaInst(groupTy, "group", entryPt);
+  new StoreInst(ConstantAggregateZero::get(groupTy), group, entryPt);
+
+  BasicBlock::iterator afterCall{ call };
+  BasicBlock *after{ BB->splitBasicBlock(++afterCall, "range.done") };
+  BasicBlock *inlineBB{ BB->splitBasicBlock(BasicBlock::iterator{ call },
+                                            "range.inline") };
+  BasicBlock *spawnBB{ BasicBlock::Create(c, "range.spawn", F, after) };
+
+  Instruction *oldBr{ BB->getTerminator() };
+  Value *n{ call->getArgOperand(hiIdx) };
+  Value *minChunkVal{ ConstantInt::get(i64Ty, minChunk) };
+  auto *oneChunk =
+      new ICmpInst(oldBr, ICmpInst::ICMP_ULE, n, minChunkVal, "");
+  BranchInst::Create(inlineBB, spawnBB, oneChunk, oldBr);
+  oldBr->eraseFromParent();
+
+  for (unsigned i = 0u, e = fields.size(); i < e; ++i) {
+    if (i == loIdx || i == hiIdx) {
+      continue;
+    }
+    Value *idx[] = { ConstantInt::get(int32Ty, 0u),
+                     ConstantInt::get(int32Ty, i) };
+    auto gep = GetElementPtrInst::Create(frame, idx, "", spawnBB);
+    new StoreInst(call->getArgOperand(i), gep, spawnBB);
+  }
+  auto bc = new BitCastInst(frame, voidStarTy, "", spawnBB);
+  Value *spawnArgs[] = { group, rangeFun, bc, call->getArgOperand(loIdx), n,
+                         minChunkVal };
+  CallInst::Create(rangeSpawn, spawnArgs, "", spawnBB);
+  Value *joinArgs[] = { group };
+  CallInst::Create(groupJoin, joinArgs, "", spawnBB);
+  BranchInst::Create(after, spawnBB);
+}
+
+//------------------------------------------------------------------------------
+// replace call, which runs the extracted loop from its loIdx-th argument to
+// its hiIdx-th, with spawns of up to LoopChunks chunks of at least minChunk
+// iterations into a group, joined before carrying on. A loop with no more
+// than one chunk's iterations is run here, as it was. Each of partials names
+// an output of call which a reduction is left in, and each chunk is given a
+// slot of its own in its place; the slots are combined after the join.
+void ParalleliseLoops::spawnChunks(
+    CallInst *call, const unsigned loIdx, const unsigned hiIdx,
+    const uint64_t minChunk,
+    const std::vector<std::pair<unsigned, Reduction::Kind> > &partials) {
+  DEBUG(dbgs() << "ParalleliseLoops::spawnChunks()\n");
+
+  BasicBlock *BB{ call->getParent() };
+  Function *F{ BB->getParent() };
+  LLVMContext &c{ F->getContext() };
+  Type *i64Ty{ Type::getInt64Ty(c) };
+  Type *int32Ty{ Type::getInt32Ty(c) };
+  Type *voidStarTy{ PointerType::getUnqual(Type::getInt8Ty(c)) };
+  const unsigned maxChunks{ std::max(1u, static_cast<unsigned>(LoopChunks)) };
+
+  StructType *frameTy;
+  Function *chunkFun{ getSpawnableFun(call->getCalledFunction(), "_Chunk_",
+                                      frameTy) };
+
+  // every chunk has a frame of its own, which must outlive the join
+  Instruction *entryPt{ &*F->getEntryBlock().getFirstInsertionPt() };
+  auto *frames = new AllocaInst(ArrayType::get(frameTy, maxChunks),
+                                "frames", entryPt);
+  auto *group = new AllocaInst(groupTy, "group", entryPt);
+  new StoreInst(ConstantAggregateZero::get(groupTy), group, entryPt);
+  std::vector<Value *> slots;
+  for (auto &p : partials) {
+    Type *ty{ cast<PointerType>(call->getArgOperand(p.first)->getType())
+                  ->getElementType() };
+    slots.push_back(
+        new AllocaInst(ArrayType::get(ty, maxChunks), "partials", entryPt));
+  }
+
+  BasicBlock::iterator afterCall{ call };
+  BasicBlock *after{ BB->splitBasicBlock(++afterCall, "chunks.done") };
+  BasicBlock *inlineBB{ BB->splitBasicBlock(BasicBlock::iterator{ call },
+                                            "chunks.inline") };
+  BasicBlock *spawnBB{ BasicBlock::Create(c, "chunks.spawn", F, after) };
+  BasicBlock *joinBB{ BasicBlock::Create(c, "chunks.join", F, after) };
+
+  // chunk = max(minChunk, ceil(n / maxChunks))
+  Instruction *oldBr{ BB->getTerminator() };
+  Value *n{ call->getArgOperand(hiIdx) };
+  Value *spread{ BinaryOperator::CreateUDiv(
+      BinaryOperator::CreateAdd(n, ConstantInt::get(i64Ty, maxChunks - 1u),
+                                "", oldBr),
+      ConstantInt::get(i64Ty, maxChunks), "", oldBr) };
+  Value *minChunkVal{ ConstantInt::get(i64Ty, minChunk) };
+  auto *spreadBigger =
+      new ICmpInst(oldBr, ICmpInst::ICMP_UGT, spread, minChunkVal, "");
+  auto *chunk = SelectInst::Create(spreadBigger, spread, minChunkVal,
+                                   "chunk.size", oldBr);
+  auto *oneChunk = new ICmpInst(oldBr, ICmpInst::ICMP_ULE, n, chunk, "");
+  BranchInst::Create(inlineBB, spawnBB, oneChunk, oldBr);
+  oldBr->eraseFromParent();
+
+  // spawn [lo, min(lo + chunk, n)) for each lo = 0, chunk, 2 * chunk, ...
+  auto *chunkLo = PHINode::Create(i64Ty, 2u, "chunk.lo", spawnBB);
+  auto *index = PHINode::Create(i64Ty, 2u, "chunk.index", spawnBB);
+  auto *next = BinaryOperator::CreateAdd(chunkLo, chunk, "", spawnBB);
+  auto *moreChunks = new ICmpInst(*spawnBB, ICmpInst::ICMP_ULT, next, n, "");
+  auto *chunkHi = SelectInst::Create(moreChunks, next, n, "chunk.hi", spawnBB);
+
+  Value *frameIdx[] = { ConstantInt::get(i64Ty, 0u), index };
+  auto *frame = GetElementPtrInst::Create(frames, frameIdx, "frame", spawnBB);
+  std::vector<Value *> args;
+  for (unsigned i = 0u, e = call->getNumArgOperands(); i < e; ++i) {
+    args.push_back(call->getArgOperand(i));
+  }
+  args[loIdx] = chunkLo;
+  args[hiIdx] = chunkHi;
+  for (unsigned r = 0u, e = partials.size(); r < e; ++r) {
+    Value *slotIdx[] = { ConstantInt::get(i64Ty, 0u), index };
+    args[partials[r].first] =
+        GetElementPtrInst::Create(slots[r], slotIdx, "partial", spawnBB);
+  }
+  for (unsigned i = 0u, e = args.size(); i < e; ++i) {
+    Value *arg{ args[i] };
+    Value *idx[] = { ConstantInt::get(int32Ty, 0u),
+                     ConstantInt::get(int32Ty, i) };
+    auto gep = GetElementPtrInst::Create(frame, idx, "", spawnBB);
+    new StoreInst(arg, gep, spawnBB);
+  }
+  // the frame points at the chunk's slot, and at whatever else the loop
+  // writes through, so it's spawned where it can't be copied elsewhere
+  auto bc = new BitCastInst(frame, voidStarTy, "", spawnBB);
+  std::vector<Value *> spawnArgs{ group, chunkFun, bc };
+  if (getTarget() == Target::Shim) {
+    spawnArgs.push_back(ConstantInt::get(i64Ty, 0u));
+  }
+  CallInst::Create(localGroupSpawn, spawnArgs, "", spawnBB);
+
+  auto *nextIndex = BinaryOperator::CreateAdd(
+      index, ConstantInt::get(i64Ty, 1u), "", spawnBB);
+  chunkLo->addIncoming(ConstantInt::get(i64Ty, 0u), BB);
+  chunkLo->addIncoming(next, spawnBB);
+  index->addIncoming(ConstantInt::get(i64Ty, 0u), BB);
+  index->addIncoming(nextIndex, spawnBB);
+  BranchInst::Create(spawnBB, joinBB, moreChunks, spawnBB);
+
+  Value *joinArgs[] = { group };
+  CallInst::Create(groupJoin, joinArgs, "", joinBB);
+  if (partials.empty()) {
+    BranchInst::Create(after, joinBB);
+    return;
+  }
+
+  // fold the chunks' slots together, in order, into the outputs the call
+  // would have left them in
+  BasicBlock *combineBB{ BasicBlock::Create(c, "chunks.combine", F, after) };
+  BasicBlock *combinedBB{ BasicBlock::Create(c, "chunks.combined", F, after) };
+  BranchInst::Create(combineBB, joinBB);
+
+  auto *slotIndex = PHINode::Create(i64Ty, 2u, "partial.index", combineBB);
+  std::vector<PHINode *> accs;
+  for (auto &p : partials) {
+    Type *ty{ cast<PointerType>(call->getArgOperand(p.first)->getType())
+                  ->getElementType() };
+    auto *acc = PHINode::Create(ty, 2u, "acc", combineBB);
+    acc->addIncoming(identityOf(p.second, ty), joinBB);
+    accs.push_back(acc);
+  }
+  auto *nextSlot = BinaryOperator::CreateAdd(
+      slotIndex, ConstantInt::get(i64Ty, 1u), "", combineBB);
+  auto *moreSlots =
+      new ICmpInst(*combineBB, ICmpInst::ICMP_ULT, nextSlot, nextIndex, "");
+  BranchInst::Create(combineBB, combinedBB, moreSlots, combineBB);
+  slotIndex->addIncoming(ConstantInt::get(i64Ty, 0u), joinBB);
+  slotIndex->addIncoming(nextSlot, combineBB);
+
+  for (unsigned r = 0u, e = partials.size(); r < e; ++r) {
+    Value *slotIdx[] = { ConstantInt::get(i64Ty, 0u), slotIndex };
+    auto *slot = GetElementPtrInst::Create(slots[r], slotIdx, "", nextSlot);
+    Value *acc{ combine(partials[r].second, accs[r],
+                        new LoadInst{ slot, "", nextSlot }, nextSlot) };
+    accs[r]->addIncoming(acc, combineBB);
+    new StoreInst(acc, call->getArgOperand(partials[r].first), combinedBB);
+  }
+  BranchInst::Create(after, combinedBB);
+}
+
+//------------------------------------------------------------------------------
+// returns L's induction variable, filling in the calls in L which can be
+// spawned a window of iterations ahead: calls in every iteration to a
+// functional function costing more than a spawn, whose arguments don't depend
+// on earlier iterations. Returns nullptr if there are none, or L's iterations
+// can't be counted.
+PHINode *ParalleliseLoops::findDeferrableCalls(
+    Loop *L, LoopInfo &LI, ScalarEvolution &SE, DominatorTree &DT,
+    std::vector<CallInst *> &calls) const {
+  DEBUG(dbgs() << "ParalleliseLoops::findDeferrableCalls() for loop at "
+               << L->getHeader()->getName() << "\n");
+
+  if (!hasCountableShape(L, SE)) {
+    return nullptr;
+  }
+  PHINode *iv{ nullptr };
+  for (auto &I : *L->getHeader()) {
+    auto *phi = dyn_cast<PHINode>(&I);
+    if (!phi || isInductionVariable(phi, L, SE)) {
+      iv = phi;
+      break;
+    }
+  }
+  if (!iv) {
+    DEBUG(dbgs() << "The loop has no induction variable.\n");
+    return nullptr;
+  }
+
+  auto &Fit = getAnalysis<Fitness>();
+  const auto &Profit = getAnalysis<Profitability>();
+  BasicBlock *latch{ L->getLoopLatch() };
+  for (auto *BB : L->getBlocks()) {
+    if (LI.getLoopFor(BB) != L || !DT.dominates(BB, latch)) {
+      continue;
+    }
+    for (auto &I : *BB) {
+      auto *ci = dyn_cast<CallInst>(&I);
+      Function *callee{ ci ? ci->getCalledFunction() : nullptr };
+      // the call's frame is copied to whichever process runs it, so it
+      // mustn't hold pointers: a functional callee takes none, and one it
+      // returned would point into the wrong process
+      if (!callee || callee->getReturnType()->isVoidTy() ||
+          callee->getReturnType()->isPointerTy() ||
+          !Fit.isFunctional(*callee)) {
+        continue;
+      }
+      const auto *funStats = Profit.getFunStats(*callee);
+      if (!funStats || funStats->totalCost <= getSpawnCost()) {
+        continue;
+      }
+
+      std::vector<Instruction *> slice;
+      bool independent{ true };
+      for (unsigned i = 0u, e = ci->getNumArgOperands(); i < e; ++i) {
+        independent = independent &&
+                      isIterationIndependent(ci->getArgOperand(i), L, iv,
+                                             slice);
+      }
+      if (independent) {
+        DEBUG(dbgs() << "Deferrable: ");
+        DEBUG(ci->print(dbgs()));
+        DEBUG(dbgs() << "\n");
+        calls.push_back(ci);
+      }
+    }
+  }
+  return calls.empty() ? nullptr : iv;
+}
+
+//------------------------------------------------------------------------------
+// find a loop in F whose calls can be deferred, and split each window of its
+// iterations in two: a loop which works out each iteration's arguments and
+// spawns its calls into a group, and, after one join, the original loop, which
+// reads the calls' results back from their frames. Returns false if there
+// were no such loops.
+bool ParalleliseLoops::deferOneLoop(Function &F) {
+  DEBUG(dbgs() << "ParalleliseLoops::deferOneLoop() for " << F.getName()
+               << "()\n");
+
+  auto &LI = getAnalysis<LoopInfo>(F);
+  auto &SE = getAnalysis<ScalarEvolution>(F);
+  auto &DT = getAnalysis<DominatorTree>(F);
+
+  Loop *L{ nullptr };
+  PHINode *iv{ nullptr };
+  std::vector<CallInst *> calls;
+  std::vector<Loop *> loops(LI.begin(), LI.end());
+  while (!iv && !loops.empty()) {
+    L = loops.back();
+    loops.pop_back();
+    iv = findDeferrableCalls(L, LI, SE, DT, calls);
+    loops.insert(loops.end(), L->begin(), L->end());
+  }
+  if (!iv) {
+    return false;
+  }
+
+  LLVMContext &c{ F.getContext() };
+  Type *i64Ty{ Type::getInt64Ty(c) };
+  Type *int32Ty{ Type::getInt32Ty(c) };
+  Type *voidStarTy{ PointerType::getUnqual(Type::getInt8Ty(c)) };
+  const unsigned window{ std::max(1u, static_cast<unsigned>(DeferWindow)) };
+  BasicBlock *preheader{ L->getLoopPreheader() };
+  BasicBlock *header{ L->getHeader() };
+  BasicBlock *latch{ L->getLoopLatch() };
+  BasicBlock *exit{ L->getExitBlock() };
+
+  // the instructions the calls' arguments take, which are worked out again
+  // from each iteration's value of iv before the calls are spawned
+  std::vector<Instruction *> slice;
+  for (auto *ci : calls) {
+    for (unsigned i = 0u, e = ci->getNumArgOperands(); i < e; ++i) {
+      isIterationIndependent(ci->getArgOperand(i), L, iv, slice);
+    }
+  }
+
+  Value *start, *step, *tripCount;
+  expandBounds(L, iv, SE, start, step, tripCount);
+
+  // each call has a frame per iteration of the window, which must outlive
+  // the join, and all of them are spawned into one group
+  Instruction *entryPt{ &*F.getEntryBlock().getFirstInsertionPt() };
+  auto *group = new AllocaInst(groupTy, "group", entryPt);
+  new StoreInst(ConstantAggregateZero::get(groupTy), group, entryPt);
+  std::vector<Function *> spawnables;
+  std::vector<StructType *> frameTys;
+  std::vector<Value *> buffers;
+  for (auto *ci : calls) {
+    StructType *frameTy;
+    spawnables.push_back(
+        getSpawnableFun(ci->getCalledFunction(), "_Deferred_", frameTy));
+    frameTys.push_back(frameTy);
+    buffers.push_back(new AllocaInst(ArrayType::get(frameTy, window),
+                                     "deferred", entryPt));
+  }
+
+  BasicBlock *headBB{ BasicBlock::Create(c, "window.head", &F, header) };
+  BasicBlock *spawnBB{ BasicBlock::Create(c, "window.spawn", &F, header) };
+  BasicBlock *joinBB{ BasicBlock::Create(c, "window.join", &F, header) };
+  BasicBlock *nextBB{ BasicBlock::Create(c, "window.next", &F, exit) };
+
+  // the window [w0, min(w0 + window, tripCount)), for w0 = 0, window, ...
+  preheader->getTerminator()->replaceUsesOfWith(header, headBB);
+  auto *w0 = PHINode::Create(i64Ty, 2u, "window.begin", headBB);
+  w0->addIncoming(ConstantInt::get(i64Ty, 0u), preheader);
+
+  // the header's other phis carry their values from one window to the next
+  for (auto &I : *header) {
+    auto *phi = dyn_cast<PHINode>(&I);
+    if (!phi) {
+      break;
+    }
+    if (phi == iv) {
+      continue;
+    }
+    auto *carried = PHINode::Create(phi->getType(), 2u, phi->getName(),
+                                    headBB);
+    carried->addIncoming(phi->getIncomingValueForBlock(preheader), preheader);
+    carried->addIncoming(phi->getIncomingValueForBlock(latch), nextBB);
+    const int fromPreheader{ phi->getBasicBlockIndex(preheader) };
+    phi->setIncomingValue(fromPreheader, carried);
+    phi->setIncomingBlock(fromPreheader, joinBB);
+  }
+
+  auto *wEnd = BinaryOperator::CreateAdd(w0, ConstantInt::get(i64Ty, window),
+                                         "", headBB);
+  auto *fits = new ICmpInst(*headBB, ICmpInst::ICMP_ULT, wEnd, tripCount, "");
+  auto *w1 = SelectInst::Create(fits, wEnd, tripCount, "window.end", headBB);
+  BranchInst::Create(spawnBB, headBB);
+
+  // for j = w0 to w1, work out iv and the calls' arguments, and spawn them
+  auto *j = PHINode::Create(i64Ty, 2u, "j", spawnBB);
+  auto *jCast = CastInst::CreateIntegerCast(j, iv->getType(), false, "",
+                                            spawnBB);
+  ValueToValueMapTy vmap;
+  vmap[iv] = BinaryOperator::CreateAdd(
+      start, BinaryOperator::CreateMul(step, jCast, "", spawnBB), "", spawnBB);
+  for (auto *I : slice) {
+    Instruction *clone{ I->clone() };
+    spawnBB->getInstList().push_back(clone);
+    RemapInstruction(clone, vmap, RF_IgnoreMissingEntries);
+    vmap[I] = clone;
+  }
+
+  auto *jSlot = BinaryOperator::CreateSub(j, w0, "", spawnBB);
+  for (unsigned r = 0u, e = calls.size(); r < e; ++r) {
+    Value *frameIdx[] = { ConstantInt::get(i64Ty, 0u), jSlot };
+    auto *frame =
+        GetElementPtrInst::Create(buffers[r], frameIdx, "frame", spawnBB);
+    for (unsigned i = 0u, n = calls[r]->getNumArgOperands(); i < n; ++i) {
+      Value *arg{ calls[r]->getArgOperand(i) };
+      if (Value *clone = vmap.lookup(arg)) {
+        arg = clone;
+      }
+      Value *idx[] = { ConstantInt::get(int32Ty, 0u),
+                       ConstantInt::get(int32Ty, i) };
+      auto gep = GetElementPtrInst::Create(frame, idx, "", spawnBB);
+      new StoreInst(arg, gep, spawnBB);
+    }
+    auto bc = new BitCastInst(frame, voidStarTy, "", spawnBB);
+    Value *spawnArgs[] = { group, spawnables[r], bc,
+                           ConstantExpr::getSizeOf(frameTys[r]) };
+    CallInst::Create(groupSpawn, spawnArgs, "", spawnBB);
+  }
+
+  auto *jNext = BinaryOperator::CreateAdd(j, ConstantInt::get(i64Ty, 1u), "",
+                                          spawnBB);
+  auto *moreSpawns = new ICmpInst(*spawnBB, ICmpInst::ICMP_ULT, jNext, w1, "");
+  BranchInst::Create(spawnBB, joinBB, moreSpawns, spawnBB);
+  j->addIncoming(w0, headBB);
+  j->addIncoming(jNext, spawnBB);
+
+  Value *joinArgs[] = { group };
+  CallInst::Create(groupJoin, joinArgs, "", joinBB);
+  BranchInst::Create(header, joinBB);
+
+  // the loop itself now runs iterations w0 to w1, entered after the join,
+  // and moves on to the next window, if any, when it's done
+  PHINode *k{ countIterations(L, iv, start, step, w0, w1, joinBB) };
+  auto *latchBr = cast<BranchInst>(latch->getTerminator());
+  for (unsigned i = 0u, e = latchBr->getNumSuccessors(); i < e; ++i) {
+    if (latchBr->getSuccessor(i) == exit) {
+      latchBr->setSuccessor(i, nextBB);
+    }
+  }
+  for (auto &I : *exit) {
+    auto *phi = dyn_cast<PHINode>(&I);
+    if (!phi) {
+      break;
+    }
+    phi->setIncomingBlock(phi->getBasicBlockIndex(latch), nextBB);
+  }
+  w0->addIncoming(w1, nextBB);
+  auto *moreWindows =
+      new ICmpInst(*nextBB, ICmpInst::ICMP_ULT, w1, tripCount, "");
+  BranchInst::Create(headBB, exit, moreWindows, nextBB);
+
+  // each call's result is read back from its frame for iteration k
+  auto *kSlot = BinaryOperator::CreateSub(k, w0, "window.slot",
+                                          &*header->getFirstInsertionPt());
+  for (unsigned r = 0u, e = calls.size(); r < e; ++r) {
+    CallInst *ci{ calls[r] };
+    Value *idx[] = { ConstantInt::get(i64Ty, 0u), kSlot,
+                     ConstantInt::get(int32Ty, 0u),
+                     ConstantInt::get(int32Ty, ci->getNumArgOperands()) };
+    auto *gep = GetElementPtrInst::Create(buffers[r], idx, "", ci);
+    ci->replaceAllUsesWith(new LoadInst{ gep, "deferred.ret", ci });
+
+    std::vector<WeakVH> args;
+    for (unsigned i = 0u, n = ci->getNumArgOperands(); i < n; ++i) {
+      args.emplace_back(ci->getArgOperand(i));
+    }
+    ci->eraseFromParent();
+    for (auto &arg : args) {
+      if (arg) {
+        RecursivelyDeleteTriviallyDeadInstructions(arg);
+      }
+    }
+  }
+  return true;
+}
+
+//------------------------------------------------------------------------------
+static RegisterPass<ParalleliseLoops>
+X("paralleliseloops", "Parallelise loops whose iterations are independent",
+  false, false);
@@ -0,0 +1,99 @@
+// Checks that a process which forks while the Thread Pool is busy leaves both
+// itself and its child with a working pool: each side joins the jobs spawned
+// before the fork and then spawns some more, and should get the same answers
+// as running serially. A join which hangs is killed by an alarm.
+//
+// Build from this directory with:
+//   clang++ -std=c++11 -O2 -pthread fork-test.cpp
+//       ../../threading/ThreadPool.cpp -o fork-test
+// then run ./fork-test, optionally with HYDRA_FIBERS=1.
+
+#include <cstdio>
+#include <cstdlib>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "../../threading/ThreadPool.h"
+
+// the frame Hydra would pack fib's argument and return value into
+struct Frame {
+  long n;
+  long ret;
+};
+
+static long fib(long n);
+
+static void spawnableFib(void *frame) {
+  auto *f = static_cast<Frame *>(frame);
+  f->ret = fib(f->n);
+}
+
+// fib with its first call spawned, so the pool has jobs queued at every level
+static long fib(const long n) {
+  if (n < 20) {
+    return n < 2 ? n : fib(n - 1) + fib(n - 2);
+  }
+  Frame f{ n - 1, 0 };
+  hydra_task *t{ spawn(spawnableFib, &f, sizeof(Frame)) };
+  const long b{ fib(n - 2) };
+  join(t);
+  return f.ret + b;
+}
+
+static long serialFib(const long n) {
+  return n < 2 ? n : serialFib(n - 1) + serialFib(n - 2);
+}
+
+// spawn fib(n - k) for k = 0 to 7 into one group, fork if asked to once they
+// are under way, then check every result on whichever side we're on
+static int run(const char *side, const long n, const bool doFork,
+               pid_t *child) {
+  Frame frames[8];
+  hydra_group group{};
+  for (long k = 0; k < 8; ++k) {
+    frames[k] = Frame{ n - k, 0 };
+    spawn(&group, spawnableFib, &frames[k], sizeof(Frame));
+  }
+
+  if (doFork) {
+    *child = fork();
+    if (*child < 0) {
+      perror("fork");
+      exit(2);
+    }
+    side = *child ? "parent" : "child";
+  }
+  join(&group);
+
+  int failures{ 0 };
+  for (long k = 0; k < 8; ++k) {
+    if (frames[k].ret != serialFib(n - k)) {
+      printf("%s: fib(%ld) gave %ld\n", side, n - k, frames[k].ret);
+      ++failures;
+    }
+  }
+  return failures;
+}
+
+int main(int argc, char **argv) {
+  const long n{ argc > 1 ? atol(argv[1]) : 30 };
+  alarm(60);
+
+  pid_t child{ -1 };
+  int failures{ run("parent", n, true, &child) };
+  failures += run(child ? "parent" : "child", n, false, &child);
+
+  if (child == 0) {
+    return failures ? 1 : 0;
+  }
+
+  int status;
+  if (waitpid(child, &status, 0) != child || !WIFEXITED(status) ||
+      WEXITSTATUS(status) != 0) {
+    puts("child failed");
+    ++failures;
+  }
+  puts(failures ? "FAILED" : "passed");
+  return failures ? 1 : 0;
+}
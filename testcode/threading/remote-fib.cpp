@@ -0,0 +1,48 @@
+// Checks that the Remote Pool runtime gives the same answers as running
+// serially, with spawns sent to local daemons.
+//
+// Build from this directory with:
+//   clang++ -std=c++11 -O2 -pthread remote-fib.cpp
+//       ../../threading/RemotePool.cpp -o remote-fib
+// then run ./remote-fib.sh to try it with 1 to 4 daemons.
+
+#include <cstdio>
+#include <cstdlib>
+
+#include "../../threading/ThreadPool.h"
+
+// the frame Hydra would pack fib's argument and return value into
+struct Frame {
+  long n;
+  long ret;
+};
+
+static long fib(const long n) { return n < 2 ? n : fib(n - 1) + fib(n - 2); }
+
+static void spawnableFib(void *frame) {
+  auto *f = static_cast<Frame *>(frame);
+  f->ret = fib(f->n);
+}
+
+int main(int argc, char **argv) {
+  const long n{ argc > 1 ? atol(argv[1]) : 35 };
+
+  // spawn fib(n - k) for k = 1 to 8, as Hydra would spawn calls sharing a join
+  Frame frames[8];
+  hydra_group group{};
+  for (long k = 0; k < 8; ++k) {
+    frames[k] = Frame{ n - 1 - k, 0 };
+    spawn(&group, spawnableFib, &frames[k], sizeof(Frame));
+  }
+  join(&group);
+
+  int failures{ 0 };
+  for (long k = 0; k < 8; ++k) {
+    if (frames[k].ret != fib(frames[k].n)) {
+      printf("fib(%ld): got %ld\n", frames[k].n, frames[k].ret);
+      ++failures;
+    }
+  }
+  printf("%s\n", failures ? "FAIL" : "PASS");
+  return failures != 0;
+}
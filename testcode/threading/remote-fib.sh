@@ -0,0 +1,20 @@
+#!/bin/bash
+
+# Run remote-fib against 1 to 4 daemons on this machine, each listening on a
+# Unix socket. Pass n as the first argument to override the default.
+
+dir=$(mktemp -d)
+pids=()
+addrs=""
+for i in 1 2 3 4; do
+  HYDRA_SERVE=unix:$dir/d$i ./remote-fib &
+  pids+=($!)
+  addrs+="${addrs:+,}unix:$dir/d$i"
+  sleep 0.2
+
+  echo "$i daemon(s):"
+  HYDRA_REMOTE=$addrs ./remote-fib "$@"
+done
+
+kill "${pids[@]}"
+rm -rf "$dir"
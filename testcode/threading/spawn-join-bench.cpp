@@ -0,0 +1,82 @@
+// Measures the spawn/join round-trip latency of the Thread Pool runtime.
+//
+// Build from this directory with:
+//   clang++ -std=c++11 -O2 -pthread spawn-join-bench.cpp
+//       ../../threading/ThreadPool.cpp -o spawn-join-bench
+// then run ./spawn-join-bench.sh to try 1 to 64 workers.
+//
+// The pool size is taken from HYDRA_NUM_THREADS, as for any other program
+// using the runtime.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#include "../../threading/ThreadPool.h"
+
+using namespace std;
+using namespace std::chrono;
+
+static void touch(void *arg) { ++*static_cast<volatile long *>(arg); }
+
+// spawn one empty task and immediately join it, rounds times
+static double roundTrip(const unsigned rounds) {
+  long counter{ 0 };
+  const auto start = steady_clock::now();
+  for (unsigned i{ 0u }; i < rounds; ++i) {
+    join(spawn(touch, &counter));
+  }
+  const auto end = steady_clock::now();
+  return duration<double, nano>(end - start).count() / rounds;
+}
+
+// spawn width empty tasks into a group before joining it, rounds times
+static double fanOut(const unsigned rounds, const unsigned width) {
+  vector<long> counters(width * 16u); // keep each counter on its own line
+  hydra_group group{};
+  const auto start = steady_clock::now();
+  for (unsigned i{ 0u }; i < rounds; ++i) {
+    for (unsigned w{ 0u }; w < width; ++w) {
+      spawn(&group, touch, &counters[w * 16u]);
+    }
+    join(&group);
+  }
+  const auto end = steady_clock::now();
+  return duration<double, nano>(end - start).count() / (rounds * width);
+}
+
+static void touchRange(void *arg, size_t lo, size_t hi) {
+  for (size_t i = lo; i < hi; ++i) {
+    touch(static_cast<long *>(arg) + i * 16u);
+  }
+}
+
+// as fanOut, but with the width tasks published as one spawn_range
+static double rangeFanOut(const unsigned rounds, const unsigned width) {
+  vector<long> counters(width * 16u);
+  hydra_group group{};
+  const auto start = steady_clock::now();
+  for (unsigned i{ 0u }; i < rounds; ++i) {
+    spawn_range(&group, touchRange, counters.data(), 0u, width, 1u);
+    join(&group);
+  }
+  const auto end = steady_clock::now();
+  return duration<double, nano>(end - start).count() / (rounds * width);
+}
+
+int main(int argc, char **argv) {
+  const unsigned rounds{ argc > 1 ? static_cast<unsigned>(atoi(argv[1]))
+                                  : 200000u };
+  const char *workers{ getenv("HYDRA_NUM_THREADS") };
+
+  // warm up the pool and the job cache
+  roundTrip(rounds / 10u + 1u);
+
+  printf("workers=%s round-trip=%.1fns fan-out(8)=%.1fns/task "
+         "fan-out(64)=%.1fns/task range(4096)=%.1fns/index\n",
+         workers ? workers : "default", roundTrip(rounds),
+         fanOut(rounds / 8u + 1u, 8u), fanOut(rounds / 64u + 1u, 64u),
+         rangeFanOut(rounds / 4096u + 1u, 4096u));
+}
@@ -0,0 +1,11 @@
+#!/bin/bash
+
+# Run spawn-join-bench with 1 to 64 workers. Pass the number of rounds as the
+# first argument to override the default.
+#
+# The benchmark's tasks are empty, so the pool would soon run them inline;
+# HYDRA_INLINE_NS=0 makes every spawn go through the deques.
+
+for n in 1 2 4 8 16 32 64; do
+  HYDRA_INLINE_NS=0 HYDRA_NUM_THREADS=$n ./spawn-join-bench "$@"
+done
@@ -41,18 +41,22 @@ for a in fitness profitability joinpoints decider; do
   rm test-module-${a}.bc test-$a-output
 done
 
-# run for each transformation pass
-for t in makespawnable parallelisecalls; do
+# run for each transformation pass, checking the IR it emits against the
+# FileCheck patterns in test-$t-expected (FileCheck is built with LLVM)
+for t in makespawnable parallelisecalls paralleliseloops; do
+  # dependence analysis can only tell accesses apart with an alias analysis
+  passes=-$t
+  if [ $t = paralleliseloops ]; then passes="-basicaa $passes"; fi
   opt -load ~/proj-files/build/Release/lib/Tests.so \
     -test-module-${t} -o test-module-${t}.bc blank.bc
   opt -load ~/proj-files/build/Release/lib/Analyses.so \
-    -load ~/proj-files/build/Release/lib/Transforms.so -$t \
-    test-module-${t}.bc -o test-module-${t}-after.bc
-  if cmp test-module-$t-after.bc test-module-$t-expected.bc
+    -load ~/proj-files/build/Release/lib/Transforms.so $passes \
+    -S test-module-${t}.bc -o test-module-${t}-after.ll
+  if FileCheck test-$t-expected < test-module-$t-after.ll
   then success $t
   else failure $t
   fi
-  rm test-module-${t}.bc test-module-$t-after.bc
+  rm test-module-${t}.bc test-module-$t-after.ll
 done
 
 echo
@@ -0,0 +1,474 @@
+// A runtime for Hydra's transformed code which runs spawned calls in a pool of
+// worker processes, rather than threads. The workers are forked when the
+// program first spawns something, so they share its code; each spawn copies
+// its frame into a slot in memory shared with them, and the join copies the
+// frame (with the return value) back. That is only sound for functions which
+// touch nothing but their arguments, which is all the Fitness analysis lets
+// through. In exchange, a crash in a worker doesn't take the program with it,
+// and each worker has an allocator to itself.
+//
+// Compile this in place of ThreadPool.cpp.
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <sched.h>
+#include <semaphore.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
+
+#include "ThreadPool.h"
+
+#define DEBUG(x)
+
+using namespace std;
+
+// read an unsigned tuning knob from the environment, or use def if it's unset
+// or malformed
+static unsigned envUnsigned(const char *name, const unsigned def) {
+  const char *value{ getenv(name) };
+  if (!value || !*value) {
+    return def;
+  }
+  char *end;
+  const unsigned long parsed{ strtoul(value, &end, 10) };
+  return *end ? def : static_cast<unsigned>(parsed);
+}
+
+// HYDRA_NUM_PROCS overrides the default of one worker per CPU we may use
+static unsigned numWorkerProcs() {
+  unsigned cpus{ thread::hardware_concurrency() };
+#ifdef __linux__
+  cpu_set_t set;
+  if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+    const unsigned allowed{ static_cast<unsigned>(CPU_COUNT(&set)) };
+    cpus = cpus ? min(cpus, allowed) : allowed;
+  }
+#endif
+  return max(1u, envUnsigned("HYDRA_NUM_PROCS", cpus));
+}
+
+// the largest frame which can be shipped to a worker; bigger ones run inline
+static constexpr size_t maxFrameSize{ 256u };
+
+// the most spawns which may be in flight at once; more run inline
+static constexpr unsigned numSlots{ 1024u };
+
+static constexpr size_t cacheLine{ 64u };
+
+static_assert(ATOMIC_INT_LOCK_FREE == 2 && ATOMIC_LLONG_LOCK_FREE == 2,
+              "shared memory needs atomics which don't take a lock");
+
+namespace {
+// a slot which is running is tagged with the pid of the process running it,
+// so that a worker's crash can be spotted
+enum SlotState : uint64_t { Free, Queued, Done, Running };
+
+static inline uint64_t runningIn(const pid_t pid) {
+  return static_cast<uint64_t>(pid) << 2u | Running;
+}
+
+static inline pid_t runner(const uint64_t state) {
+  return (state & 3u) == Running ? static_cast<pid_t>(state >> 2u) : 0;
+}
+
+// one spawn, as seen by both the program and the workers
+struct alignas(cacheLine) Slot {
+  atomic<uint64_t> state;
+  void (*f)(void *);
+  alignas(16) char frame[maxFrameSize];
+
+  // returns true if the caller, process pid, won the right to run this slot
+  bool claim(const pid_t pid) {
+    uint64_t expected{ Queued };
+    return state.compare_exchange_strong(expected, runningIn(pid),
+                                         memory_order_acquire,
+                                         memory_order_relaxed);
+  }
+
+  void run() {
+    f(frame);
+    state.store(Done, memory_order_release);
+  }
+};
+
+// a bounded queue of slot numbers, which any process may push or pop (see
+// Dmitry Vyukov's bounded MPMC queue). A join which runs its own slot leaves
+// the slot's number behind, to be skipped by whoever pops it, so the queue can
+// still fill up even though there are as many cells as slots.
+class SlotQueue {
+  struct Cell {
+    atomic<uint64_t> seq;
+    unsigned slot;
+  };
+
+  Cell cells[numSlots];
+  alignas(cacheLine) atomic<uint64_t> head; // the next cell to pop
+  alignas(cacheLine) atomic<uint64_t> tail; // the next cell to push
+
+public:
+  SlotQueue() : head{ 0u }, tail{ 0u } {
+    for (unsigned i = 0u; i < numSlots; ++i) {
+      cells[i].seq.store(i, memory_order_relaxed);
+    }
+  }
+
+  // returns false if the queue is full
+  bool push(const unsigned slot) {
+    uint64_t pos{ tail.load(memory_order_relaxed) };
+    for (;;) {
+      Cell &cell = cells[pos % numSlots];
+      const uint64_t seq{ cell.seq.load(memory_order_acquire) };
+      if (seq == pos) {
+        if (tail.compare_exchange_weak(pos, pos + 1u,
+                                       memory_order_relaxed)) {
+          cell.slot = slot;
+          cell.seq.store(pos + 1u, memory_order_release);
+          return true;
+        }
+      } else if (seq < pos) {
+        return false;
+      } else {
+        pos = tail.load(memory_order_relaxed);
+      }
+    }
+  }
+
+  // returns false if the queue is empty
+  bool pop(unsigned &slot) {
+    uint64_t pos{ head.load(memory_order_relaxed) };
+    for (;;) {
+      Cell &cell = cells[pos % numSlots];
+      const uint64_t seq{ cell.seq.load(memory_order_acquire) };
+      if (seq == pos + 1u) {
+        if (head.compare_exchange_weak(pos, pos + 1u,
+                                       memory_order_relaxed)) {
+          slot = cell.slot;
+          cell.seq.store(pos + numSlots, memory_order_release);
+          return true;
+        }
+      } else if (seq <= pos) {
+        return false;
+      } else {
+        pos = head.load(memory_order_relaxed);
+      }
+    }
+  }
+};
+
+// everything the workers can see, in one anonymous shared mapping
+struct Shared {
+  sem_t work; // posted once per queued slot, and once per worker to stop
+  atomic<bool> stop;
+  SlotQueue queue;
+  Slot slots[numSlots];
+};
+
+class ProcessPool {
+  Shared *shared;
+
+  // the rest is only seen by the program itself
+  const unsigned numProcs;
+  vector<pid_t> workers;
+  mutex workers_mutex;
+
+  vector<unsigned> freeSlots;
+  mutex slots_mutex;
+  void *homes[numSlots];  // where each slot's frame came from
+  size_t sizes[numSlots]; // and how big it is
+
+  pid_t startWorker();
+  bool workerAlive(pid_t pid);
+  bool runQueued();
+
+public:
+  ProcessPool();
+  ~ProcessPool();
+  hydra_task *spawn(void (*f)(void *), void *frame, size_t frameSize);
+  void join(hydra_task *task);
+};
+}
+
+// true in a worker, where spawns run inline
+static bool inWorker{ false };
+
+ProcessPool::ProcessPool() : numProcs{ numWorkerProcs() } {
+  void *p{ mmap(nullptr, sizeof(Shared), PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_ANONYMOUS, -1, 0) };
+  if (p == MAP_FAILED) {
+    perror("hydra: mapping the process pool");
+    abort();
+  }
+  shared = new (p) Shared;
+  sem_init(&shared->work, 1, 0u);
+  shared->stop.store(false, memory_order_relaxed);
+  for (unsigned i = 0u; i < numSlots; ++i) {
+    shared->slots[i].state.store(Free, memory_order_relaxed);
+  }
+
+  // hand out low slots first, to keep the shared pages touched down
+  freeSlots.reserve(numSlots);
+  for (unsigned i = numSlots; i > 0u; --i) {
+    freeSlots.push_back(i - 1u);
+  }
+
+  for (unsigned i = 0u; i < numProcs; ++i) {
+    const pid_t pid{ startWorker() };
+    if (pid > 0) {
+      workers.push_back(pid);
+    }
+  }
+  DEBUG(fprintf(stderr, "hydra: started %zu worker processes\n",
+                workers.size()));
+}
+
+ProcessPool::~ProcessPool() {
+  shared->stop.store(true, memory_order_release);
+  for (size_t i = 0u; i < workers.size(); ++i) {
+    sem_post(&shared->work);
+  }
+  for (auto pid : workers) {
+    waitpid(pid, nullptr, 0);
+  }
+  sem_destroy(&shared->work);
+  shared->~Shared();
+  munmap(shared, sizeof(Shared));
+}
+
+// fork a worker, which runs queued slots until the pool stops. Returns its
+// pid, or -1 if it couldn't be started (its share of the work is then done by
+// the other workers, or by joins).
+pid_t ProcessPool::startWorker() {
+  const pid_t pid{ fork() };
+  if (pid != 0) {
+    if (pid < 0) {
+      perror("hydra: starting a worker process");
+    }
+    return pid;
+  }
+
+  // only the thread which forked exists in here, so nothing else may be used
+  // which another thread could have held a lock on
+  inWorker = true;
+#ifdef __linux__
+  // don't outlive the program
+  prctl(PR_SET_PDEATHSIG, SIGKILL);
+#endif
+  const pid_t self{ getpid() };
+  for (;;) {
+    while (sem_wait(&shared->work) != 0 && errno == EINTR) {
+    }
+    if (shared->stop.load(memory_order_acquire)) {
+      break;
+    }
+
+    // a join may have run it already, having popped it first or not
+    unsigned i;
+    if (!shared->queue.pop(i)) {
+      continue;
+    }
+    Slot &s = shared->slots[i];
+    if (s.claim(self)) {
+      s.run();
+    }
+  }
+
+  // the program's exit handlers and buffered output aren't ours to run
+  _exit(0);
+}
+
+// returns false if pid has died, having replaced it
+bool ProcessPool::workerAlive(const pid_t pid) {
+  auto l = unique_lock<mutex>(workers_mutex);
+  auto it = find(workers.begin(), workers.end(), pid);
+  if (it == workers.end()) {
+    // already found dead by somebody else
+    return false;
+  }
+  int status;
+  if (waitpid(pid, &status, WNOHANG) != pid) {
+    return true;
+  }
+
+  fprintf(stderr, "hydra: worker process %d died; rerunning its job\n",
+          static_cast<int>(pid));
+  const pid_t replacement{ startWorker() };
+  if (replacement > 0) {
+    *it = replacement;
+  } else {
+    workers.erase(it);
+  }
+  return false;
+}
+
+// run a queued slot here rather than wait idly; returns false if there were
+// none
+bool ProcessPool::runQueued() {
+  unsigned i;
+  if (!shared->queue.pop(i)) {
+    return false;
+  }
+  Slot &s = shared->slots[i];
+  if (s.claim(getpid())) {
+    s.run();
+  }
+  return true;
+}
+
+hydra_task *ProcessPool::spawn(void (*f)(void *), void *frame,
+                               const size_t frameSize) {
+  unsigned i{ numSlots };
+  if (frameSize <= maxFrameSize) {
+    auto l = unique_lock<mutex>(slots_mutex);
+    if (!freeSlots.empty()) {
+      i = freeSlots.back();
+      freeSlots.pop_back();
+    }
+  }
+  if (i == numSlots) {
+    // nowhere to put it; a null task needs no join
+    f(frame);
+    return nullptr;
+  }
+
+  Slot &s = shared->slots[i];
+  s.f = f;
+  memcpy(s.frame, frame, frameSize);
+  homes[i] = frame;
+  sizes[i] = frameSize;
+  s.state.store(Queued, memory_order_release);
+  // make room by running (or skipping) whatever's at the head
+  while (!shared->queue.push(i)) {
+    runQueued();
+  }
+  sem_post(&shared->work);
+  return reinterpret_cast<hydra_task *>(&s);
+}
+
+void ProcessPool::join(hydra_task *task) {
+  Slot &s = *reinterpret_cast<Slot *>(task);
+  const unsigned i{ static_cast<unsigned>(&s - shared->slots) };
+  const pid_t self{ getpid() };
+
+  // run it here if no worker has taken it yet
+  if (s.claim(self)) {
+    s.run();
+  }
+
+  // otherwise help with the rest of the queue, then back off. Every so often,
+  // check that the worker running it is still there.
+  unsigned rounds{ 0u };
+  for (uint64_t state; (state = s.state.load(memory_order_acquire)) != Done;) {
+    if (runQueued()) {
+      continue;
+    }
+    const pid_t pid{ runner(state) };
+    if (++rounds % 1024u == 0u && pid != self && !workerAlive(pid)) {
+      // the frame's arguments are untouched, so just run it again
+      s.state.store(runningIn(self), memory_order_relaxed);
+      s.run();
+      break;
+    }
+    if (rounds < 64u) {
+      sched_yield();
+    } else {
+      usleep(50u);
+    }
+  }
+
+  // the frame holds the return value now
+  memcpy(homes[i], s.frame, sizes[i]);
+  s.state.store(Free, memory_order_relaxed);
+  auto l = unique_lock<mutex>(slots_mutex);
+  freeSlots.push_back(i);
+}
+
+// the pool, which forks its workers the first time anything is spawned
+static ProcessPool &pool() {
+  static ProcessPool p;
+  return p;
+}
+
+// the spawns into groups which this thread hasn't joined yet
+static thread_local vector<pair<hydra_group *, hydra_task *> > groupTasks;
+
+hydra_task *spawn(void (*f)(void *), void *frame, size_t frameSize) {
+  if (inWorker) {
+    // a worker has no workers of its own
+    f(frame);
+    return nullptr;
+  }
+  return pool().spawn(f, frame, frameSize);
+}
+
+void spawn(hydra_group *group, void (*f)(void *), void *frame,
+           size_t frameSize) {
+  assert(group);
+  if (hydra_task *task = spawn(f, frame, frameSize)) {
+    groupTasks.emplace_back(group, task);
+  }
+}
+
+// without its size, a frame can't be copied anywhere, so f is run here
+hydra_task *spawn(void (*f)(void *), void *frame) {
+  f(frame);
+  return nullptr;
+}
+
+void spawn(hydra_group *, void (*f)(void *), void *frame) { f(frame); }
+
+// spawns aren't told apart by where they're made here, so ip goes unused
+hydra_task *spawnTask(hydra_group *group, void (*f)(void *), void *frame,
+                      size_t frameSize, const void *) {
+  if (!frameSize) {
+    f(frame);
+    return nullptr;
+  }
+  if (group) {
+    spawn(group, f, frame, frameSize);
+    return nullptr;
+  }
+  return spawn(f, frame, frameSize);
+}
+
+// a range's iterations share one frame, and leave their results wherever it
+// points, which the worker processes can't write to, so the range is run here
+void spawn_range(hydra_group *, void (*body)(void *, size_t, size_t),
+                 void *frame, size_t begin, size_t end, size_t) {
+  if (begin < end) {
+    body(frame, begin, end);
+  }
+}
+
+void join(hydra_task *task) {
+  if (task) {
+    pool().join(task);
+  }
+}
+
+void join(hydra_group *group) {
+  assert(group);
+  // newest first, as they're most likely to still be queued
+  for (size_t i = groupTasks.size(); i > 0u; --i) {
+    if (groupTasks[i - 1u].first == group) {
+      pool().join(groupTasks[i - 1u].second);
+      groupTasks.erase(groupTasks.begin() + (i - 1u));
+    }
+  }
+}
@@ -0,0 +1,471 @@
+// A runtime for Hydra's transformed code which sends spawned calls to worker
+// daemons over sockets, so that a program can use more cores than one machine
+// has. A daemon is just the same program started with HYDRA_SERVE set to the
+// address to listen on; it serves spawns until it is killed, and never runs
+// main. The program lists its daemons in HYDRA_REMOTE, and each spawn sends
+// its function and frame to one of them, which sends the frame (with the
+// return value) back. That is only sound for functions which touch nothing but
+// their arguments, which is all the Fitness analysis lets through.
+//
+// A daemon runs whatever function and frame any peer that connects sends it,
+// with nothing but a check that the peer was built the same way, so it must
+// only be reachable by the programs it serves: it listens on loopback unless
+// given a host to listen on, and a unix socket is only as safe as its path's
+// permissions.
+//
+// Addresses are either host:port (TCP) or unix:path. A daemon runs the spawns
+// from one connection one at a time, so start one per core, or list the same
+// daemon several times to connect to it more than once. Daemons must run the
+// same binary on the same kind of machine as the program: function pointers
+// and frames are sent as they are.
+//
+// Compile this in place of ThreadPool.cpp.
+
+#include <atomic>
+#include <cassert>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "ThreadPool.h"
+
+#define DEBUG(x)
+
+using namespace std;
+
+// the largest frame which is sent to a daemon; bigger ones run inline
+static constexpr uint32_t maxFrameSize{ 4096u };
+
+// sent first on every connection, to check that both ends are the same binary
+static constexpr uint32_t helloMagic{ 0x48594452u }; // "HYDR"
+
+namespace {
+struct Hello {
+  uint32_t magic;
+  int64_t layout; // where this file's functions are relative to each other
+};
+
+// a spawned call, followed by its frame
+struct Request {
+  int64_t f; // the function, relative to anchor()
+  uint32_t size;
+};
+}
+
+// function pointers are sent relative to this, as the daemon may have been
+// loaded at another address
+static void anchor() {}
+
+static int64_t offsetOf(void (*f)(void *)) {
+  return reinterpret_cast<intptr_t>(f) - reinterpret_cast<intptr_t>(&anchor);
+}
+
+static int64_t layout() {
+  void (*other)(void *){ [](void *) {} };
+  return offsetOf(other);
+}
+
+// read or write all of n bytes; returns false if the connection failed
+static bool readAll(const int fd, void *buf, size_t n) {
+  auto *p = static_cast<char *>(buf);
+  while (n > 0u) {
+    const ssize_t got{ recv(fd, p, n, 0) };
+    if (got <= 0) {
+      if (got < 0 && errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    p += got;
+    n -= static_cast<size_t>(got);
+  }
+  return true;
+}
+
+static bool writeAll(const int fd, const void *buf, size_t n) {
+  const auto *p = static_cast<const char *>(buf);
+  while (n > 0u) {
+    const ssize_t sent{ send(fd, p, n, MSG_NOSIGNAL) };
+    if (sent < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    p += sent;
+    n -= static_cast<size_t>(sent);
+  }
+  return true;
+}
+
+// make a socket for addr, and bind or connect it; returns -1 on failure
+static int openSocket(const string &addr, const bool listening) {
+  int fd{ -1 };
+  if (addr.compare(0u, 5u, "unix:") == 0) {
+    sockaddr_un sa{};
+    sa.sun_family = AF_UNIX;
+    const string path{ addr.substr(5u) };
+    if (path.size() >= sizeof(sa.sun_path)) {
+      return -1;
+    }
+    strcpy(sa.sun_path, path.c_str());
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listening) {
+      unlink(sa.sun_path);
+    }
+    const auto *p = reinterpret_cast<const sockaddr *>(&sa);
+    if (fd >= 0 && (listening ? bind(fd, p, sizeof(sa))
+                              : connect(fd, p, sizeof(sa))) != 0) {
+      close(fd);
+      fd = -1;
+    }
+    return fd;
+  }
+
+  const auto colon = addr.rfind(':');
+  if (colon == string::npos) {
+    return -1;
+  }
+  const string host{ addr.substr(0u, colon) }, port{ addr.substr(colon + 1u) };
+  addrinfo hints{};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  // a daemon given no host (":port") only listens on loopback; any other
+  // interface has to be asked for by its address
+  addrinfo *results;
+  if (getaddrinfo(host.empty() ? "127.0.0.1" : host.c_str(), port.c_str(),
+                  &hints, &results) != 0) {
+    return -1;
+  }
+  for (addrinfo *ai = results; ai; ai = ai->ai_next) {
+    fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (fd < 0) {
+      continue;
+    }
+    if (listening) {
+      const int yes{ 1 };
+      setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    }
+    if ((listening ? bind(fd, ai->ai_addr, ai->ai_addrlen)
+                   : connect(fd, ai->ai_addr, ai->ai_addrlen)) == 0) {
+      break;
+    }
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(results);
+
+  if (fd >= 0) {
+    // spawns are small and latency matters more than packing them together
+    const int yes{ 1 };
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+  }
+  return fd;
+}
+
+//------------------------------------------------------------------------------
+// the daemon
+
+// true in a daemon, where spawns run inline
+static bool serving{ false };
+
+// run spawns sent on fd until the other end hangs up
+static void serveConnection(const int fd) {
+  Hello hello;
+  if (!readAll(fd, &hello, sizeof(hello))) {
+    close(fd);
+    return;
+  }
+  const char ok = hello.magic == helloMagic && hello.layout == layout();
+  if (!writeAll(fd, &ok, 1u) || !ok) {
+    close(fd);
+    return;
+  }
+
+  unique_ptr<char[]> frame{ new char[maxFrameSize] };
+  Request req;
+  while (readAll(fd, &req, sizeof(req)) && req.size <= maxFrameSize &&
+         readAll(fd, frame.get(), req.size)) {
+    auto *f = reinterpret_cast<void (*)(void *)>(
+        reinterpret_cast<intptr_t>(&anchor) + req.f);
+    f(frame.get());
+    if (!writeAll(fd, frame.get(), req.size)) {
+      break;
+    }
+  }
+  close(fd);
+}
+
+static void serve(const string &addr) {
+  serving = true;
+  const int fd{ openSocket(addr, true) };
+  if (fd < 0 || listen(fd, SOMAXCONN) != 0) {
+    fprintf(stderr, "hydra: can't listen on %s\n", addr.c_str());
+    exit(1);
+  }
+  fprintf(stderr, "hydra: serving spawns on %s\n", addr.c_str());
+
+  for (;;) {
+    const int conn{ accept(fd, nullptr, nullptr) };
+    if (conn < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      perror("hydra: accept");
+      exit(1);
+    }
+    thread{ serveConnection, conn }.detach();
+  }
+}
+
+namespace {
+// a program started with HYDRA_SERVE becomes a daemon before main is reached
+struct ServeIfAsked {
+  ServeIfAsked() {
+    if (const char *addr = getenv("HYDRA_SERVE")) {
+      serve(addr);
+    }
+  }
+} serveIfAsked;
+}
+
+//------------------------------------------------------------------------------
+// the program
+
+namespace {
+struct Connection;
+
+// one spawn which has been sent and not yet joined
+struct Task {
+  Connection *conn;
+  void (*f)(void *);
+  void *frame;
+  uint32_t size;
+  bool done;   // the frame has been copied back
+  bool failed; // the connection broke first, so it has to run here
+};
+
+// replies come back in the order their requests were sent
+struct Connection {
+  int fd;
+  bool broken;
+  deque<Task *> inFlight;
+  mutex m;
+};
+
+class RemotePool {
+  vector<unique_ptr<Connection> > conns;
+  atomic<unsigned> next;
+
+  void fail(Connection &c);
+
+public:
+  RemotePool();
+  ~RemotePool();
+  hydra_task *spawn(void (*f)(void *), void *frame, size_t frameSize);
+  void join(hydra_task *task);
+};
+}
+
+// connect to every daemon in HYDRA_REMOTE; those which can't be reached are
+// left out, with a warning
+RemotePool::RemotePool() : next{ 0u } {
+  const char *list{ getenv("HYDRA_REMOTE") };
+  string addrs{ list ? list : "" };
+  for (size_t start = 0u; start < addrs.size();) {
+    size_t end{ addrs.find(',', start) };
+    if (end == string::npos) {
+      end = addrs.size();
+    }
+    const string addr{ addrs.substr(start, end - start) };
+    start = end + 1u;
+    if (addr.empty()) {
+      continue;
+    }
+
+    const int fd{ openSocket(addr, false) };
+    const Hello hello{ helloMagic, layout() };
+    char ok{ 0 };
+    if (fd < 0 || !writeAll(fd, &hello, sizeof(hello)) ||
+        !readAll(fd, &ok, 1u) || !ok) {
+      fprintf(stderr, "hydra: can't use the daemon at %s\n", addr.c_str());
+      if (fd >= 0) {
+        close(fd);
+      }
+      continue;
+    }
+    conns.emplace_back(new Connection);
+    conns.back()->fd = fd;
+    conns.back()->broken = false;
+  }
+  DEBUG(fprintf(stderr, "hydra: connected to %zu daemons\n", conns.size()));
+}
+
+RemotePool::~RemotePool() {
+  for (auto &c : conns) {
+    close(c->fd);
+  }
+}
+
+// everything still in flight on c has to be run here instead; the caller
+// holds c.m
+void RemotePool::fail(Connection &c) {
+  if (!c.broken) {
+    fprintf(stderr, "hydra: lost a daemon; running its spawns here\n");
+  }
+  c.broken = true;
+  for (auto *t : c.inFlight) {
+    t->failed = true;
+  }
+  c.inFlight.clear();
+}
+
+hydra_task *RemotePool::spawn(void (*f)(void *), void *frame,
+                              const size_t frameSize) {
+  if (!conns.empty() && frameSize <= maxFrameSize) {
+    // try each daemon in turn, starting with the next one round. A join
+    // waiting for a reply holds its connection, so skip those at first.
+    const unsigned first{ next.fetch_add(1u, memory_order_relaxed) };
+    const unsigned n{ static_cast<unsigned>(conns.size()) };
+    for (unsigned i = 0u; i < 2u * n; ++i) {
+      Connection &c = *conns[(first + i) % n];
+      auto l = i < n ? unique_lock<mutex>(c.m, try_to_lock)
+                     : unique_lock<mutex>(c.m);
+      if (!l.owns_lock() || c.broken) {
+        continue;
+      }
+
+      const Request req{ offsetOf(f), static_cast<uint32_t>(frameSize) };
+      if (!writeAll(c.fd, &req, sizeof(req)) ||
+          !writeAll(c.fd, frame, frameSize)) {
+        fail(c);
+        continue;
+      }
+      auto *t = new Task{ &c, f, frame, req.size, false, false };
+      c.inFlight.push_back(t);
+      return reinterpret_cast<hydra_task *>(t);
+    }
+  }
+
+  // nowhere to send it; a null task needs no join
+  f(frame);
+  return nullptr;
+}
+
+void RemotePool::join(hydra_task *task) {
+  auto *t = reinterpret_cast<Task *>(task);
+  Connection &c = *t->conn;
+  {
+    // read replies until ours comes in, handing out those before it
+    unique_ptr<char[]> reply{ new char[maxFrameSize] };
+    auto l = unique_lock<mutex>(c.m);
+    while (!t->done && !t->failed) {
+      Task *first{ c.inFlight.front() };
+      if (!readAll(c.fd, reply.get(), first->size)) {
+        fail(c);
+        break;
+      }
+      memcpy(first->frame, reply.get(), first->size);
+      first->done = true;
+      c.inFlight.pop_front();
+    }
+  }
+
+  if (t->failed) {
+    // the frame's arguments are untouched, so just run it here
+    t->f(t->frame);
+  }
+  delete t;
+}
+
+// the connections, which are made the first time anything is spawned
+static RemotePool &pool() {
+  static RemotePool p;
+  return p;
+}
+
+// the spawns into groups which this thread hasn't joined yet
+static thread_local vector<pair<hydra_group *, hydra_task *> > groupTasks;
+
+hydra_task *spawn(void (*f)(void *), void *frame, size_t frameSize) {
+  if (serving) {
+    // a daemon has no daemons of its own
+    f(frame);
+    return nullptr;
+  }
+  return pool().spawn(f, frame, frameSize);
+}
+
+void spawn(hydra_group *group, void (*f)(void *), void *frame,
+           size_t frameSize) {
+  assert(group);
+  if (hydra_task *task = spawn(f, frame, frameSize)) {
+    groupTasks.emplace_back(group, task);
+  }
+}
+
+// without its size, a frame can't be sent anywhere, so f is run here
+hydra_task *spawn(void (*f)(void *), void *frame) {
+  f(frame);
+  return nullptr;
+}
+
+void spawn(hydra_group *, void (*f)(void *), void *frame) { f(frame); }
+
+// spawns aren't told apart by where they're made here, so ip goes unused
+hydra_task *spawnTask(hydra_group *group, void (*f)(void *), void *frame,
+                      size_t frameSize, const void *) {
+  if (!frameSize) {
+    f(frame);
+    return nullptr;
+  }
+  if (group) {
+    spawn(group, f, frame, frameSize);
+    return nullptr;
+  }
+  return spawn(f, frame, frameSize);
+}
+
+// a range's iterations share one frame, and leave their results wherever it
+// points, which the daemons can't write to, so the range is run here
+void spawn_range(hydra_group *, void (*body)(void *, size_t, size_t),
+                 void *frame, size_t begin, size_t end, size_t) {
+  if (begin < end) {
+    body(frame, begin, end);
+  }
+}
+
+void join(hydra_task *task) {
+  if (task) {
+    pool().join(task);
+  }
+}
+
+void join(hydra_group *group) {
+  assert(group);
+  // oldest first, as their replies come back first
+  for (size_t i = 0u; i < groupTasks.size();) {
+    if (groupTasks[i].first == group) {
+      pool().join(groupTasks[i].second);
+      groupTasks.erase(groupTasks.begin() + i);
+    } else {
+      ++i;
+    }
+  }
+}
@@ -0,0 +1,204 @@
+// The runtime which code transformed with -hydra-target=shim calls into. It
+// picks another runtime when the program starts, according to HYDRA_RUNTIME,
+// so that one binary can be timed against each of them:
+//
+// * pool (the default): whichever pool the program is linked with, i.e.
+//   ThreadPool.cpp, ProcessPool.cpp or RemotePool.cpp.
+// * threads: a std::thread per spawn, as -hydra-target=threads would give.
+// * tbb: a tbb::task_group per spawn (or per sync group). Only available if
+//   this file is compiled with -DHYDRA_TBB and linked with -ltbb.
+// * serial: run every spawn inline, as if it had never been parallelised.
+//
+// Compile this along with one of the pools.
+
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#ifdef HYDRA_TBB
+#include <tbb/task_group.h>
+#endif
+
+#include "ThreadPool.h"
+
+using namespace std;
+
+namespace {
+enum Runtime { Pool, Threads, TBB, Serial };
+}
+
+static Runtime chooseRuntime() {
+  const char *name{ getenv("HYDRA_RUNTIME") };
+  if (!name || !*name || strcmp(name, "pool") == 0) {
+    return Pool;
+  } else if (strcmp(name, "threads") == 0) {
+    return Threads;
+  } else if (strcmp(name, "serial") == 0) {
+    return Serial;
+  } else if (strcmp(name, "tbb") == 0) {
+#ifdef HYDRA_TBB
+    return TBB;
+#else
+    fprintf(stderr, "hydra: built without TBB; using the pool\n");
+    return Pool;
+#endif
+  }
+  fprintf(stderr, "hydra: unknown HYDRA_RUNTIME %s; using the pool\n", name);
+  return Pool;
+}
+
+static const Runtime runtime{ chooseRuntime() };
+
+namespace {
+// what a task handle points to, for the runtimes other than the pool
+struct Task {
+  virtual ~Task() {}
+  virtual void join() = 0;
+};
+
+struct ThreadTask : Task {
+  thread t;
+  ThreadTask(void (*f)(void *), void *frame) : t{ f, frame } {}
+  void join() override { t.join(); }
+};
+
+#ifdef HYDRA_TBB
+struct TBBTask : Task {
+  unique_ptr<tbb::task_group> tasks{ new tbb::task_group };
+  void join() override { tasks->wait(); }
+};
+#endif
+}
+
+// the spawns into groups which this thread hasn't joined yet, for the
+// runtimes other than the pool
+static thread_local vector<pair<hydra_group *, unique_ptr<Task> > > groupTasks;
+
+static Task *newTask(void (*f)(void *), void *frame) {
+  switch (runtime) {
+  case Threads:
+    return new ThreadTask{ f, frame };
+#ifdef HYDRA_TBB
+  case TBB: {
+    auto *t = new TBBTask;
+    t->tasks->run([=] { f(frame); });
+    return t;
+  }
+#endif
+  default:
+    f(frame);
+    return nullptr;
+  }
+}
+
+namespace {
+// part of a range, spawned as a task of its own
+struct RangePiece {
+  void (*body)(void *, size_t, size_t);
+  void *frame;
+  size_t lo, hi;
+};
+}
+
+static void runPiece(void *p) {
+  unique_ptr<RangePiece> piece{ static_cast<RangePiece *>(p) };
+  piece->body(piece->frame, piece->lo, piece->hi);
+}
+
+extern "C" {
+// the pool is told where our caller spawned from, as the spawn would seem to
+// come from here whenever this isn't compiled into a tail call (e.g. at -O0)
+hydra_task *hydra_spawn(void (*f)(void *), void *frame, size_t frameSize) {
+  if (runtime == Pool) {
+    return spawnTask(nullptr, f, frame, frameSize,
+                     __builtin_return_address(0));
+  }
+  return reinterpret_cast<hydra_task *>(newTask(f, frame));
+}
+
+void hydra_join(hydra_task *task) {
+  if (runtime == Pool) {
+    join(task);
+  } else if (task) {
+    unique_ptr<Task> t{ reinterpret_cast<Task *>(task) };
+    t->join();
+  }
+}
+
+// a frameSize of 0 means the frame can't be copied anywhere, e.g. because it
+// points into this process, which spawnTask takes as an unsized spawn
+void hydra_group_spawn(hydra_group *group, void (*f)(void *), void *frame,
+                       size_t frameSize) {
+  assert(group);
+  if (runtime == Pool) {
+    spawnTask(group, f, frame, frameSize, __builtin_return_address(0));
+    return;
+  }
+
+#ifdef HYDRA_TBB
+  if (runtime == TBB) {
+    // a group shares one task_group, so one wait covers all of it
+    for (auto &p : groupTasks) {
+      if (p.first == group) {
+        static_cast<TBBTask *>(p.second.get())->tasks->run([=] { f(frame); });
+        return;
+      }
+    }
+  }
+#endif
+  if (Task *t = newTask(f, frame)) {
+    groupTasks.emplace_back(group, unique_ptr<Task>{ t });
+  }
+}
+
+void hydra_spawn_range(hydra_group *group,
+                       void (*body)(void *, size_t, size_t), void *frame,
+                       size_t begin, size_t end, size_t grain) {
+  assert(group);
+  if (runtime == Pool) {
+    spawn_range(group, body, frame, begin, end, grain);
+    return;
+  }
+  if (runtime == Serial || end <= begin) {
+    if (begin < end) {
+      body(frame, begin, end);
+    }
+    return;
+  }
+
+  // the other runtimes don't split ranges, so cut it into a piece per CPU
+  const size_t n{ end - begin };
+  grain = grain ? grain : 1u;
+  const size_t pieces{ min<size_t>((n + grain - 1u) / grain,
+                                   max(thread::hardware_concurrency(), 1u)) };
+  const size_t size{ (n + pieces - 1u) / pieces };
+  for (size_t lo = begin; lo < end; lo += size) {
+    hydra_group_spawn(group, runPiece,
+                      new RangePiece{ body, frame, lo, min(lo + size, end) },
+                      sizeof(RangePiece));
+  }
+}
+
+void hydra_group_join(hydra_group *group) {
+  assert(group);
+  if (runtime == Pool) {
+    join(group);
+    return;
+  }
+
+  for (size_t i = 0u; i < groupTasks.size();) {
+    if (groupTasks[i].first == group) {
+      groupTasks[i].second->join();
+      groupTasks.erase(groupTasks.begin() + i);
+    } else {
+      ++i;
+    }
+  }
+}
+}
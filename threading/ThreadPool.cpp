@@ -1,366 +1,2333 @@
 #include <algorithm>
 #include <atomic>
 #include <cassert>
-#include <climits>
+#include <cctype>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <cstdint>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <new>
 #include <mutex>
+#include <sstream>
+#include <string>
+#include <tuple>
 #include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/mman.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <dirent.h>
+#include <sched.h>
+#endif
 
 #include "ThreadPool.h"
 
 #define DEBUG(x) 
 
-#ifndef NUM_THREADS
-#error "Num threads not specificed!"
-#endif
+using namespace std;
+
+// read an unsigned tuning knob from the environment, or use def if it's unset
+// or malformed
+static unsigned envUnsigned(const char *name, const unsigned def) {
+  const char *value{ getenv(name) };
+  if (!value || !*value) {
+    return def;
+  }
+  char *end;
+  const unsigned long parsed{ strtoul(value, &end, 10) };
+  return *end ? def : static_cast<unsigned>(parsed);
+}
+
+// returns the number of CPUs allowed by the cgroup CPU quota (v1 or v2) of
+// this process, or 0 if there is no quota
+static unsigned cgroupCPULimit() {
+  // find this process's cgroup, relative to the cgroup mount points
+  string v1Path, v2Path;
+  ifstream cgroups{ "/proc/self/cgroup" };
+  for (string line; getline(cgroups, line);) {
+    // lines look like "hierarchy-ID:controller-list:cgroup-path"
+    const auto colon1 = line.find(':');
+    const auto colon2 = line.find(':', colon1 + 1);
+    if (colon1 == string::npos || colon2 == string::npos) {
+      continue;
+    }
+    const string controllers{ line.substr(colon1 + 1, colon2 - colon1 - 1) };
+    const string path{ line.substr(colon2 + 1) };
+    if (controllers.empty()) {
+      v2Path = path;
+    } else if (("," + controllers + ",").find(",cpu,") != string::npos) {
+      v1Path = path;
+    }
+  }
+
+  // try the process's own cgroup first, then the root of the mount, which is
+  // what a container usually sees
+  auto readQuota = [](const string &file, double &out) {
+    ifstream in{ file };
+    string quota, period;
+    if (!(in >> quota)) {
+      return false;
+    }
+    if (!(in >> period)) {
+      // v1 keeps the period in a separate file
+      ifstream periodIn{ file.substr(0, file.rfind("quota_us")) + "period_us" };
+      periodIn >> period;
+    }
+    if (quota == "max" || quota == "-1") {
+      return false;
+    }
+    const double p{ atof(period.c_str()) };
+    out = p > 0.0 ? atof(quota.c_str()) / p : 0.0;
+    return out > 0.0;
+  };
+
+  double cpus{ 0.0 };
+  if (readQuota("/sys/fs/cgroup" + v2Path + "/cpu.max", cpus) ||
+      readQuota("/sys/fs/cgroup/cpu.max", cpus) ||
+      readQuota("/sys/fs/cgroup/cpu" + v1Path + "/cpu.cfs_quota_us", cpus) ||
+      readQuota("/sys/fs/cgroup/cpu/cpu.cfs_quota_us", cpus)) {
+    // round partial CPUs up, so a quota of 1.5 CPUs gets 2 workers
+    return max(1u, static_cast<unsigned>(cpus + 0.999));
+  }
+  return 0u;
+}
+
+// the default worker count: the number of CPUs this process may actually use
+static unsigned availableCPUs() {
+  unsigned cpus{ thread::hardware_concurrency() };
+
+#ifdef __linux__
+  cpu_set_t set;
+  if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+    const unsigned allowed{ static_cast<unsigned>(CPU_COUNT(&set)) };
+    cpus = cpus ? min(cpus, allowed) : allowed;
+  }
+
+  const unsigned quota{ cgroupCPULimit() };
+  if (quota) {
+    cpus = cpus ? min(cpus, quota) : quota;
+  }
+#endif
+
+  return max(1u, cpus);
+}
+
+// HYDRA_NUM_THREADS overrides everything; otherwise compiling with
+// -DNUM_THREADS=n still fixes the default, as it used to. HYDRA_NUM_THREADS=0
+// leaves jobs to the threads which join them and any the host lends the pool
+// (see hydra_help).
+static unsigned numWorkerThreads() {
+#ifdef NUM_THREADS
+  const unsigned def{ NUM_THREADS };
+#else
+  const unsigned def{ availableCPUs() };
+#endif
+  return envUnsigned("HYDRA_NUM_THREADS", max(1u, def));
+}
+
+namespace {
+// where a CPU sits in the machine, as far as placing workers is concerned
+struct CPUInfo {
+  unsigned cpu;
+  unsigned node;    // NUMA node
+  unsigned package; // socket
+  unsigned core;    // physical core within the package
+};
+}
+
+#ifdef __linux__
+static bool readSysUnsigned(const string &path, unsigned &out) {
+  ifstream in{ path };
+  return static_cast<bool>(in >> out);
+}
+
+// returns the NUMA node of cpu, or 0 if the kernel doesn't say
+static unsigned cpuNode(const unsigned cpu) {
+  const string dir{ "/sys/devices/system/cpu/cpu" + to_string(cpu) };
+  unsigned node{ 0u };
+  if (DIR *d = opendir(dir.c_str())) {
+    while (dirent *e = readdir(d)) {
+      if (string{ e->d_name }.compare(0, 4, "node") == 0 &&
+          isdigit(e->d_name[4])) {
+        node = static_cast<unsigned>(atoi(e->d_name + 4));
+        break;
+      }
+    }
+    closedir(d);
+  }
+  return node;
+}
+
+// describe every CPU this process is allowed to run on
+static vector<CPUInfo> readTopology() {
+  vector<CPUInfo> cpus;
+  cpu_set_t set;
+  if (sched_getaffinity(0, sizeof(set), &set) != 0) {
+    return cpus;
+  }
+
+  for (unsigned cpu{ 0u }; cpu < CPU_SETSIZE; ++cpu) {
+    if (!CPU_ISSET(cpu, &set)) {
+      continue;
+    }
+    const string topo{ "/sys/devices/system/cpu/cpu" + to_string(cpu) +
+                       "/topology/" };
+    CPUInfo info{ cpu, cpuNode(cpu), 0u, cpu };
+    readSysUnsigned(topo + "physical_package_id", info.package);
+    readSysUnsigned(topo + "core_id", info.core);
+    cpus.push_back(info);
+  }
+  return cpus;
+}
+#endif
+
+// parse a list of CPUs like "0,2,4-7"
+static vector<unsigned> parseCPUList(const string &list) {
+  vector<unsigned> cpus;
+  istringstream in{ list };
+  for (string range; getline(in, range, ',');) {
+    unsigned first, last;
+    const int n{ sscanf(range.c_str(), "%u-%u", &first, &last) };
+    if (n == 1) {
+      cpus.push_back(first);
+    } else if (n == 2) {
+      for (unsigned cpu{ first }; cpu <= last; ++cpu) {
+        cpus.push_back(cpu);
+      }
+    }
+  }
+  return cpus;
+}
+
+// decide which CPU each of n workers should be pinned to, according to the
+// HYDRA_AFFINITY policy:
+//   compact - fill one NUMA node (and each core's SMT siblings) before the next
+//   scatter - spread workers round-robin across NUMA nodes
+//   cores   - one worker per physical core before doubling up on siblings
+//   a list of CPUs such as "0,2,4-7" - pin worker i to the i-th CPU listed
+// returns an empty vector if workers should be left unpinned
+static vector<CPUInfo> placeWorkers(const unsigned n) {
+  vector<CPUInfo> placement;
+#ifdef __linux__
+  const char *env{ getenv("HYDRA_AFFINITY") };
+  if (!env || !*env || string{ env } == "none") {
+    return placement;
+  }
+  const string policy{ env };
+
+  auto cpus = readTopology();
+  if (cpus.empty()) {
+    return placement;
+  }
+
+  auto byLocation = [](const CPUInfo &a, const CPUInfo &b) {
+    return make_tuple(a.node, a.package, a.core, a.cpu) <
+           make_tuple(b.node, b.package, b.core, b.cpu);
+  };
+  sort(cpus.begin(), cpus.end(), byLocation);
+
+  vector<CPUInfo> order;
+  if (policy == "compact") {
+    order = cpus;
+  } else if (policy == "scatter" || policy == "cores") {
+    // give every CPU a rank among the CPUs of its node (scatter) or among
+    // the SMT siblings of its core (cores), then take all rank 0s first
+    map<tuple<unsigned, unsigned, unsigned>, unsigned> seen;
+    vector<pair<unsigned, CPUInfo>> ranked;
+    for (const auto &c : cpus) {
+      const auto key = policy == "scatter"
+                           ? make_tuple(c.node, 0u, 0u)
+                           : make_tuple(c.node, c.package, c.core);
+      ranked.emplace_back(seen[key]++, c);
+    }
+    stable_sort(ranked.begin(), ranked.end(),
+                [](const pair<unsigned, CPUInfo> &a,
+                   const pair<unsigned, CPUInfo> &b) {
+      return a.first < b.first;
+    });
+    for (const auto &r : ranked) {
+      order.push_back(r.second);
+    }
+  } else {
+    for (unsigned cpu : parseCPUList(policy)) {
+      auto it = find_if(cpus.begin(), cpus.end(),
+                        [cpu](const CPUInfo &c) { return c.cpu == cpu; });
+      if (it != cpus.end()) {
+        order.push_back(*it);
+      }
+    }
+  }
+
+  if (order.empty()) {
+    cerr << "Hydra: ignoring unusable HYDRA_AFFINITY=" << policy << "\n";
+    return placement;
+  }
+
+  // with more workers than CPUs, wrap around
+  for (unsigned i{ 0u }; i < n; ++i) {
+    placement.push_back(order[i % order.size()]);
+  }
+#endif
+  return placement;
+}
+
+static void pinThread(thread &t, const unsigned cpu) {
+#ifdef __linux__
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  pthread_setaffinity_np(t.native_handle(), sizeof(set), &set);
+#endif
+}
+
+namespace {
+// HYDRA_PLACEMENT offers each job to a preferred worker as well as queueing
+// it as usual, so that jobs over the same data tend to run where that data is
+// already in cache:
+//   args - by the frame's first word (its first argument, which is usually a
+//          pointer to the data), or by the frame's address for unsized spawns
+//   cpu  - the worker pinned to the spawner's CPU, or one on its NUMA node
+enum Placement { NoPlacement, ArgsPlacement, CPUPlacement };
+}
+
+static Placement readPlacement() {
+  const char *value{ getenv("HYDRA_PLACEMENT") };
+  if (!value || !*value || string{ value } == "none") {
+    return NoPlacement;
+  } else if (string{ value } == "args") {
+    return ArgsPlacement;
+  } else if (string{ value } == "cpu") {
+    return CPUPlacement;
+  }
+  cerr << "Hydra: ignoring unknown HYDRA_PLACEMENT=" << value << "\n";
+  return NoPlacement;
+}
+
+static const Placement jobPlacement{ readPlacement() };
+
+// global mutex for writting to the console
+DEBUG(static mutex console_mutex);
+
+// anything written by one thread while others poll it gets a cache line of its
+// own, so that unrelated threads don't keep stealing the line from each other
+static constexpr size_t cacheLine{ 64u };
+
+// before C++17, new needn't honour alignments stricter than max_align_t, so
+// anything which is over-aligned for cacheLine is allocated with these
+template <typename T> static T *newAligned() {
+  void *p;
+  if (posix_memalign(&p, cacheLine, sizeof(T))) {
+    throw bad_alloc{};
+  }
+  return new (p) T;
+}
+
+template <typename T> static void deleteAligned(T *p) {
+  p->~T();
+  free(p);
+}
+
+// HYDRA_STATS=text (or any other value) or HYDRA_STATS=json turns on the
+// per-thread counters below, which are dumped to stderr at exit and on SIGUSR1
+enum StatsFormat { NoStats, TextStats, JSONStats };
+
+static StatsFormat readStatsFormat() {
+  const char *value{ getenv("HYDRA_STATS") };
+  if (!value || !*value) {
+    return NoStats;
+  }
+  return string{ value } == "json" ? JSONStats : TextStats;
+}
+
+static const StatsFormat statsFormat{ readStatsFormat() };
+
+enum Counter : unsigned {
+  Spawned,      // jobs published for other threads to steal
+  Inlined,      // spawns run on the spot, as there was nowhere to queue them
+  Elided,       // spawns run on the spot, as their site's jobs are too small
+  Executed,     // published jobs run by this thread
+  Steals,       // jobs taken from other threads' deques
+  Placed,       // offered jobs which this worker took from its mailbox
+  Splits,       // halves of a spawn_range given away for other threads
+  FailedSteals, // searches of every deque which found nothing
+  Parks,        // times this thread went to sleep for lack of work
+  Suspends,     // joins which put their fiber aside until they could go on
+  ExecNs,       // time spent running jobs, excluding nested joins
+  JoinWaitNs,   // time spent in join, excluding jobs run while waiting
+  NumCounters
+};
+
+static const char *const counterNames[NumCounters] = {
+  "spawned", "inlined", "elided", "executed", "steals", "placed", "splits",
+  "failed_steals", "parks", "suspends", "exec_ns", "join_wait_ns"
+};
+
+namespace {
+// one thread's counters. Only that thread writes them, so increments needn't
+// be atomic read-modify-writes; they're atomic so that a dump can read them.
+struct alignas(cacheLine) Stats {
+  atomic<uint64_t> counts[NumCounters];
+  Stats() {
+    for (auto &c : counts) {
+      c.store(0u, memory_order_relaxed);
+    }
+  }
+};
+
+// HYDRA_TRACE=file records what each thread does in a ring buffer of its own,
+// and writes the lot to file as a Chrome trace (for chrome://tracing or
+// Perfetto) when the pool is torn down
+static const char *readTraceFile() {
+  const char *value{ getenv("HYDRA_TRACE") };
+  return value && *value ? value : nullptr;
+}
+
+static const char *const traceFile{ readTraceFile() };
+
+enum TraceKind : unsigned {
+  SpawnEvent,   // a job was published
+  RunEvent,     // a published job ran, from start to dur later
+  InlineEvent,  // a spawn was run on the spot
+  JoinWaitEvent // a join waited for a job which was running elsewhere
+};
+
+struct TraceEvent {
+  uint64_t start, dur; // ns since the pool was created
+  uint64_t id;         // ties a job's spawn to its run, or 0
+  const void *fn;      // the function spawned, or null for a group join
+  TraceKind kind;
+};
+
+// only the owning thread records events, so the ring needs no locking. Once
+// it wraps round, the oldest events are overwritten.
+class TraceBuffer {
+  static constexpr uint64_t capacity{ 1u << 16 }; // must be a power of two
+  TraceEvent events[capacity];
+  atomic<uint64_t> head{ 0u };
+
+public:
+  void record(const TraceEvent &e) {
+    const uint64_t h{ head.load(memory_order_relaxed) };
+    events[h & (capacity - 1u)] = e;
+    head.store(h + 1u, memory_order_release);
+  }
+
+  // call f on each event still in the ring, oldest first
+  template <typename F> void forEach(F f) const {
+    const uint64_t h{ head.load(memory_order_acquire) };
+    for (uint64_t i{ h > capacity ? h - capacity : 0u }; i < h; ++i) {
+      f(events[i & (capacity - 1u)]);
+    }
+  }
+};
+
+class WorkDeque;
+struct Fiber;
+
+// what the runtime has learnt about one spawn site, which is identified by the
+// return address of its call to spawn. Updates from different threads may
+// race, but that only loses the odd sample.
+struct alignas(cacheLine) Site {
+  atomic<const void *> ip;
+  atomic<uint64_t> avgNs; // moving average of its jobs' durations, 0 if none
+
+  void record(const uint64_t ns) {
+    const uint64_t avg{ avgNs.load(memory_order_relaxed) };
+    avgNs.store(avg ? avg - avg / 8u + ns / 8u : max<uint64_t>(ns, 1u),
+                memory_order_relaxed);
+  }
+};
+}
+
+// spawn sites whose jobs take less than this on average are run inline; 0
+// turns this off. Set when the pool is built, from HYDRA_INLINE_NS or by
+// measuring how much a spawn costs.
+static uint64_t inlineThresholdNs;
+
+// sites are never removed, and if the table fills up, new sites just aren't
+// tracked
+static constexpr unsigned numSites{ 1u << 10 }; // must be a power of two
+static Site sites[numSites];
+
+static Site *findSite(const void *ip) {
+  constexpr unsigned maxProbes{ 16u };
+  const size_t h{ hash<const void *>{}(ip) };
+  for (unsigned i{ 0u }; i < maxProbes; ++i) {
+    auto &site = sites[(h + i) & (numSites - 1u)];
+    const void *found{ site.ip.load(memory_order_relaxed) };
+    if (!found && site.ip.compare_exchange_strong(found, ip,
+                                                  memory_order_relaxed)) {
+      return &site;
+    }
+    if (found == ip) {
+      return &site;
+    }
+  }
+  return nullptr;
+}
+
+// each thread times one in every samplePeriod of its spawns
+static constexpr unsigned samplePeriod{ 8u };
+static thread_local unsigned sampleCountdown{ samplePeriod };
+
+namespace {
+// a Job is Pending once it has been published, until exactly one thread
+// claims it; that thread runs it and then marks it Done
+enum JobState : unsigned { Free, Pending, Claimed, Done };
+
+// the joiner polls state while the runner writes it, so keep each Job to its
+// own cache line
+struct alignas(cacheLine) Job {
+  void (*f)(void *);
+  void *frame; // f's packed arguments, owned by the spawner
+  hydra_group *group; // the group joined along with, or null if it has a handle
+  Site *site;         // where to record how long it took, if it's being timed
+  uint64_t traceId;   // only set when tracing
+  atomic<unsigned> state;
+  atomic<WorkDeque *> runner; // the deque of the thread which claimed it
+  atomic<Fiber *> waiter;     // a fiber put aside until this is Done
+  bool token; // holds one of the jobserver's tokens until it's been run
+
+  // for part of a spawn_range, f is runRange and frame is the Job itself,
+  // which holds the range's body and frame, and the indices left to run
+  void (*body)(void *, size_t, size_t);
+  void *bodyFrame;
+  size_t lo, hi, grain;
+};
+
+// a bounded Chase-Lev deque: the owning thread pushes and pops at the bottom,
+// while every other thread steals from the top
+class WorkDeque {
+  static constexpr long capacity{ 1l << 12 }; // must be a power of two
+
+  // thieves CAS top, while the owner writes bottom on every push and pop
+  alignas(cacheLine) atomic<long> top;
+  alignas(cacheLine) atomic<long> bottom;
+  alignas(cacheLine) atomic<Job *> buffer[capacity];
+
+public:
+  Stats stats; // kept by whichever thread owns this deque
+  TraceBuffer *trace{ nullptr }; // likewise, allocated on its first event
+
+  WorkDeque() : top{ 0l }, bottom{ 0l } {}
+  ~WorkDeque() { delete trace; }
+  bool empty() const;
+  bool full() const;
+  void push(Job *j);
+  Job *peek() const;
+  Job *pop();
+  Job *steal();
+};
+}
+
+// may be called from any thread, but the answer may be stale by the time the
+// caller looks at it
+bool WorkDeque::empty() const {
+  return top.load(memory_order_acquire) >= bottom.load(memory_order_acquire);
+}
+
+// only call from the owning thread. Thieves only ever shrink the deque, so if
+// this returns false the next push is guaranteed to succeed.
+bool WorkDeque::full() const {
+  return bottom.load(memory_order_relaxed) - top.load(memory_order_acquire) >=
+         capacity;
+}
+
+// only call from the owning thread, and only if the deque isn't full
+void WorkDeque::push(Job *j) {
+  const long b{ bottom.load(memory_order_relaxed) };
+  assert(b - top.load(memory_order_relaxed) < capacity);
+  buffer[b & (capacity - 1)].store(j, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  bottom.store(b + 1, memory_order_relaxed);
+}
+
+// only call from the owning thread; returns the job pop would return, without
+// removing it
+Job *WorkDeque::peek() const {
+  const long b{ bottom.load(memory_order_relaxed) };
+  if (top.load(memory_order_acquire) >= b) {
+    return nullptr;
+  }
+  return buffer[(b - 1) & (capacity - 1)].load(memory_order_relaxed);
+}
+
+// only call from the owning thread; returns nullptr if the deque is empty
+Job *WorkDeque::pop() {
+  const long b{ bottom.load(memory_order_relaxed) - 1 };
+  bottom.store(b, memory_order_relaxed);
+  atomic_thread_fence(memory_order_seq_cst);
+  long t{ top.load(memory_order_relaxed) };
+
+  if (t > b) {
+    // the deque was already empty
+    bottom.store(b + 1, memory_order_relaxed);
+    return nullptr;
+  }
+
+  Job *j{ buffer[b & (capacity - 1)].load(memory_order_relaxed) };
+  if (t == b) {
+    // last element: race any thieves for it
+    if (!top.compare_exchange_strong(t, t + 1, memory_order_seq_cst,
+                                     memory_order_relaxed)) {
+      j = nullptr;
+    }
+    bottom.store(b + 1, memory_order_relaxed);
+  }
+  return j;
+}
+
+// may be called from any thread; returns nullptr if there was nothing to take
+// or another thread won the race for it
+Job *WorkDeque::steal() {
+  long t{ top.load(memory_order_acquire) };
+  atomic_thread_fence(memory_order_seq_cst);
+  const long b{ bottom.load(memory_order_acquire) };
+
+  if (t >= b) {
+    return nullptr;
+  }
+
+  Job *j{ buffer[t & (capacity - 1)].load(memory_order_relaxed) };
+  if (!top.compare_exchange_strong(t, t + 1, memory_order_seq_cst,
+                                   memory_order_relaxed)) {
+    return nullptr;
+  }
+  return j;
+}
+
+// Jobs are recycled but never freed, since a deque may still hold a stale
+// pointer to a Job that was claimed through another route. A stale pointer is
+// harmless: whoever follows it must still win the claim on the Job's state.
+static mutex free_jobs_mutex;
+static vector<Job *> free_jobs;
+
+namespace {
+class JobCache {
+  vector<Job *> jobs;
+
+public:
+  ~JobCache();
+  Job *get();
+  void put(Job *j) { jobs.push_back(j); }
+};
+}
+
+JobCache::~JobCache() {
+  auto l = unique_lock<mutex>(free_jobs_mutex);
+  free_jobs.insert(free_jobs.end(), jobs.begin(), jobs.end());
+}
+
+Job *JobCache::get() {
+  if (jobs.empty()) {
+    auto l = unique_lock<mutex>(free_jobs_mutex);
+    if (free_jobs.empty()) {
+      l.unlock();
+      auto *j = newAligned<Job>();
+      j->state = Free;
+      return j;
+    }
+    jobs.swap(free_jobs);
+  }
+  auto *j = jobs.back();
+  jobs.pop_back();
+  return j;
+}
+
+static thread_local JobCache jobCache;
+
+// each thread that spawns work pushes it onto its own deque. Workers own one
+// each; any other thread is given one the first time it spawns.
+static thread_local WorkDeque *localDeque{ nullptr };
+
+// the NUMA node a pinned worker runs on, or -1 if we don't know
+static thread_local int localNode{ -1 };
+
+// a job run on a fiber (see fibersEnabled) may be put aside on one thread and
+// carry on on another, so it must never reuse a thread_local's address across
+// a join. Code which touches thread_locals after running a job or joining goes
+// through a function which isn't inlined, and so looks the address up afresh.
+#define FRESH_TLS __attribute__((noinline))
+
+static FRESH_TLS WorkDeque *currentDeque() { return localDeque; }
+
+// add n to one of the calling thread's counters, if stats are being kept
+static inline void count(const Counter c, const uint64_t n = 1u) {
+  if (statsFormat != NoStats && localDeque) {
+    auto &x = localDeque->stats.counts[c];
+    x.store(x.load(memory_order_relaxed) + n, memory_order_relaxed);
+  }
+}
+
+// count, for code which may have run a job, and so changed threads, since it
+// last touched a thread_local
+static FRESH_TLS void countFresh(const Counter c) { count(c); }
+
+static inline uint64_t nowNs() {
+  return chrono::duration_cast<chrono::nanoseconds>(
+             chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// time already charged to the calling thread, so that nested joins and jobs
+// can be taken out of the time charged to whatever encloses them
+static inline uint64_t chargedNs() {
+  if (!localDeque) {
+    return 0u;
+  }
+  const auto &counts = localDeque->stats.counts;
+  return counts[ExecNs].load(memory_order_relaxed) +
+         counts[JoinWaitNs].load(memory_order_relaxed);
+}
+
+// call f on frame, timing it if stats are being kept
+static void run(void (*f)(void *), void *frame) {
+  if (statsFormat == NoStats) {
+    f(frame);
+    return;
+  }
+  WorkDeque *d{ localDeque };
+  const uint64_t start{ nowNs() }, charged{ chargedNs() };
+  f(frame);
+  // if f moved to another thread, its time there isn't worth untangling
+  if (d && currentDeque() == d) {
+    auto &x = d->stats.counts[ExecNs];
+    const auto &w = d->stats.counts[JoinWaitNs];
+    const uint64_t nested{ x.load(memory_order_relaxed) +
+                           w.load(memory_order_relaxed) - charged };
+    x.store(x.load(memory_order_relaxed) + nowNs() - start - nested,
+            memory_order_relaxed);
+  }
+}
+
+// when the pool was created, which trace timestamps are relative to
+static uint64_t traceEpoch;
+
+// record an event in the calling thread's trace
+static void traceEvent(const TraceKind kind, const void *fn,
+                       const uint64_t id, const uint64_t start,
+                       const uint64_t end) {
+  if (!localDeque) {
+    return;
+  }
+  if (!localDeque->trace) {
+    localDeque->trace = new TraceBuffer;
+  }
+  localDeque->trace->record(
+      TraceEvent{ start - traceEpoch, end - start, id, fn, kind });
+}
+
+// returns true if the caller won the right to run j
+static inline bool claim(Job *j) {
+  unsigned expected{ Pending };
+  return j->state.compare_exchange_strong(expected, Claimed,
+                                          memory_order_acquire,
+                                          memory_order_relaxed);
+}
+
+// HYDRA_FIBERS=1 runs each job a worker picks up on a fiber (a user-space
+// context with a small stack of its own), so that when the job has to wait in
+// join, the fiber can be put aside while its worker gets on with other work.
+static const bool fibersEnabled{ envUnsigned("HYDRA_FIBERS", 0u) != 0u };
+
+// a fiber's stack size, in KiB
+static const size_t fiberStackSize{ envUnsigned("HYDRA_FIBER_STACK", 256u) *
+                                    size_t{ 1024u } };
+
+// HYDRA_JOBSERVER=name shares a budget of published jobs between every
+// process run with the same name, so that several programs on one host don't
+// each start a worker per CPU and oversubscribe it between them. The tokens
+// live in a named semaphore, created with HYDRA_JOBSERVER_TOKENS (by default,
+// one per CPU) by whichever process gets there first. A spawn takes a token,
+// or runs inline if there are none left, and the token is put back once the
+// job has run. As with make's jobserver, each process's own thread runs
+// without one.
+static sem_t *openJobserver() {
+  const char *name{ getenv("HYDRA_JOBSERVER") };
+  if (!name || !*name) {
+    return nullptr;
+  }
+
+  const string path{ name[0] == '/' ? string{ name } : "/" + string{ name } };
+  const unsigned tokens{ envUnsigned("HYDRA_JOBSERVER_TOKENS",
+                                     availableCPUs()) };
+  sem_t *sem{ sem_open(path.c_str(), O_CREAT, 0666, tokens) };
+  if (sem == SEM_FAILED) {
+    perror("hydra: can't open HYDRA_JOBSERVER");
+    return nullptr;
+  }
+  return sem;
+}
+
+static sem_t *const jobserver{ openJobserver() };
+
+// stored in a Job's waiter once it's run, so that nobody waits for it after
+static Fiber *const doneWaiting{ reinterpret_cast<Fiber *>(uintptr_t{ 1u }) };
+
+static void makeReady(Fiber *f);
+
+static void finishRun(Job *j, uint64_t start);
+
+// run j, which the caller has claimed
+static void runClaimed(Job *j) {
+  j->runner.store(localDeque, memory_order_relaxed);
+  const uint64_t start{ traceFile || j->site ? nowNs() : 0u };
+  run(j->f, j->frame);
+  finishRun(j, start);
+}
+
+// account for j, which has just been run, and hand it back
+static FRESH_TLS void finishRun(Job *j, const uint64_t start) {
+  Site *site{ j->site };
+  count(Executed);
+  if (j->token) {
+    sem_post(jobserver);
+  }
+  if (traceFile || site) {
+    const uint64_t end{ nowNs() };
+    if (site) {
+      site->record(end - start);
+    }
+    if (traceFile) {
+      traceEvent(RunEvent, (const void *)j->f, j->traceId, start, end);
+    }
+  }
+
+  if (hydra_group *g = j->group) {
+    // nobody joins a grouped job itself, so its runner recycles it
+    j->state.store(Free, memory_order_relaxed);
+    g->pending.fetch_sub(1u, memory_order_release);
+    jobCache.put(j);
+  } else {
+    // a fiber waiting for j must be woken before j is marked Done, as j may
+    // be recycled as soon as that store is visible
+    if (fibersEnabled) {
+      Fiber *w{ j->waiter.exchange(doneWaiting, memory_order_acq_rel) };
+      if (w) {
+        makeReady(w);
+      }
+    }
+    j->state.store(Done, memory_order_release);
+  }
+}
+
+// runs j if nobody else has claimed it yet; returns true if it ran j
+static bool execute(Job *j) {
+  if (!claim(j)) {
+    return false;
+  }
+  runClaimed(j);
+  return true;
+}
+
+// the cost of publishing a job and running it, measured on a deque nobody
+// else can see. A job which is stolen costs several times that again, in
+// cache misses and wake-ups, hence the factor.
+static uint64_t measureSpawnOverhead() {
+  constexpr unsigned rounds{ 1000u }, factor{ 8u };
+  auto *d = newAligned<WorkDeque>();
+  auto *j = newAligned<Job>();
+  j->f = [](void *) {};
+  j->frame = nullptr;
+
+  const uint64_t start{ nowNs() };
+  for (unsigned i{ 0u }; i < rounds; ++i) {
+    j->state.store(Pending, memory_order_release);
+    d->push(j);
+    Job *k{ d->pop() };
+    if (claim(k)) {
+      k->f(k->frame);
+      k->state.store(Done, memory_order_release);
+    }
+  }
+  const uint64_t elapsed{ nowNs() - start };
+
+  deleteAligned(j);
+  deleteAligned(d);
+  return factor * elapsed / rounds;
+}
+
+// returns a different pseudo-random number each call, for picking victims
+static inline unsigned nextRandom() {
+  static thread_local unsigned x{ static_cast<unsigned>(
+      hash<thread::id>{}(this_thread::get_id())) | 1u };
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return x;
+}
+
+// reserve some deques for threads outside the pool (e.g. the main thread)
+static constexpr unsigned numExternalDeques{ 64u };
+
+namespace {
+// runs one job after another on a stack of its own. Fibers are kept for reuse
+// by whichever worker they finish a job on.
+struct Fiber {
+  ucontext_t ctx;
+  char *stack; // starting with a guard page
+  size_t size;
+  Job *job;    // the job to run when next switched to
+};
+
+// why a fiber last switched back to its worker
+enum FiberExit { Finished, Waiting, Yielded };
+
+// each worker's side of the switch
+struct FiberScheduler {
+  ucontext_t ctx;              // the worker's own stack
+  Fiber *current{ nullptr };   // the fiber it's running, if any
+  FiberExit exit;
+  Job *waitingOn;              // what current waits for, if exit is Waiting
+  vector<Fiber *> spareFibers; // finished fibers, for reuse
+
+  ~FiberScheduler();
+};
+}
+
+static void fiberMain();
+
+static Fiber *newFiber() {
+  const size_t page{ static_cast<size_t>(sysconf(_SC_PAGESIZE)) };
+  auto *f = new Fiber;
+  f->size = fiberStackSize + page;
+  void *p{ mmap(nullptr, f->size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0) };
+  if (p == MAP_FAILED) {
+    delete f;
+    throw bad_alloc{};
+  }
+  // overflowing the stack faults rather than scribbling on its neighbour
+  mprotect(p, page, PROT_NONE);
+  f->stack = static_cast<char *>(p);
+
+  getcontext(&f->ctx);
+  f->ctx.uc_stack.ss_sp = f->stack + page;
+  f->ctx.uc_stack.ss_size = fiberStackSize;
+  f->ctx.uc_link = nullptr;
+  makecontext(&f->ctx, fiberMain, 0);
+  return f;
+}
+
+static void deleteFiber(Fiber *f) {
+  munmap(f->stack, f->size);
+  delete f;
+}
+
+FiberScheduler::~FiberScheduler() {
+  for (auto *f : spareFibers) {
+    deleteFiber(f);
+  }
+}
+
+static thread_local FiberScheduler localScheduler;
+
+static FRESH_TLS FiberScheduler &scheduler() { return localScheduler; }
+
+// put the calling fiber aside until waitOn is Done, or just until its worker
+// has looked for other work if waitOn is null
+static FRESH_TLS void suspendFiber(Job *waitOn) {
+  auto &s = scheduler();
+  Fiber *self{ s.current };
+  assert(self);
+  s.exit = waitOn ? Waiting : Yielded;
+  s.waitingOn = waitOn;
+  count(Suspends);
+  swapcontext(&self->ctx, &s.ctx);
+}
+
+// pop a job off this thread's deque and run it; returns false if there were
+// none
+static FRESH_TLS bool runOwnJob() {
+  Job *k{ localDeque ? localDeque->pop() : nullptr };
+  if (k) {
+    execute(k);
+  }
+  return k;
+}
+
+static FRESH_TLS bool onFiber() { return localScheduler.current; }
+
+static void fiberMain() {
+  for (;;) {
+    Fiber *self{ scheduler().current };
+    runClaimed(self->job);
+
+    // the job may have moved this fiber to another worker
+    auto &s = scheduler();
+    s.exit = Finished;
+    swapcontext(&self->ctx, &s.ctx);
+  }
+}
+
+namespace {
+// builds up the stats report without allocating, so that it's safe to use in
+// a signal handler, and writes it to stderr in as few writes as possible
+class StatsWriter {
+  char buf[4096];
+  size_t len{ 0u };
+
+  void put(const char c) {
+    if (len == sizeof(buf)) {
+      flush();
+    }
+    buf[len++] = c;
+  }
+
+  void pad(const size_t used, const unsigned width) {
+    for (size_t i{ used }; i < width; ++i) {
+      put(' ');
+    }
+  }
+
+public:
+  ~StatsWriter() { flush(); }
+
+  void flush() {
+    size_t done{ 0u };
+    while (done < len) {
+      const ssize_t n{ write(STDERR_FILENO, buf + done, len - done) };
+      if (n <= 0) {
+        break;
+      }
+      done += static_cast<size_t>(n);
+    }
+    len = 0u;
+  }
+
+  // s, right-aligned in a field of width
+  StatsWriter &str(const char *s, const unsigned width = 0u) {
+    size_t n{ 0u };
+    while (s[n]) {
+      ++n;
+    }
+    pad(n, width);
+    for (size_t i{ 0u }; i < n; ++i) {
+      put(s[i]);
+    }
+    return *this;
+  }
+
+  // n in decimal, right-aligned in a field of width
+  StatsWriter &num(uint64_t n, const unsigned width = 0u) {
+    char digits[20];
+    size_t k{ 0u };
+    do {
+      digits[k++] = static_cast<char>('0' + n % 10u);
+      n /= 10u;
+    } while (n);
+    pad(k, width);
+    while (k) {
+      put(digits[--k]);
+    }
+    return *this;
+  }
+};
+
+// everything belonging to one worker thread, in a record of its own so that
+// no two workers' state shares a cache line
+struct alignas(cacheLine) Worker {
+  WorkDeque deque;
+  int node{ -1 };        // the NUMA node it's pinned to, or -1 if it isn't
+  int cpu{ -1 };         // the CPU it's pinned to, or -1 if it isn't
+  bool running{ false }; // guarded by workers_mutex
+  thread t;
+
+  // jobs offered to this worker in particular, which are also queued on
+  // their spawners' deques. Each may have been run (or even recycled) since,
+  // so it's only a hint to try claiming it. Spawners fill the slots in turn,
+  // overwriting any offer which hasn't been taken yet.
+  static constexpr unsigned mailboxSize{ 16u };
+  alignas(cacheLine) atomic<unsigned> mailboxNext{ 0u };
+  alignas(cacheLine) atomic<Job *> mailbox[mailboxSize];
+
+  Worker() {
+    for (auto &m : mailbox) {
+      m.store(nullptr, memory_order_relaxed);
+    }
+  }
+
+  Job *takeOffer();
+};
+
+class ThreadPool {
+  const unsigned numThreads;
+  const unsigned maxDeques;
+  vector<Worker *> workers;
+  vector<unsigned> cpuWorkers; // the worker for each CPU, for CPUPlacement
+  atomic<bool> stop;
+  atomic<bool> forking; // see prepareFork
+
+  // workers are only started when there's work which no sleeping worker can
+  // take, up to numThreads of them. numRunning may briefly lag behind the
+  // workers' running flags, which are what workers_mutex protects.
+  atomic<unsigned> numRunning;
+  mutex workers_mutex;
+
+  // idle workers spin for spinRounds unsuccessful searches, then park on
+  // sleep_cv until assignJob wakes them. A worker which stays parked for
+  // idleTimeout exits, unless idleTimeout is zero. numSleeping is bumped on
+  // every park, so keep it away from the read-mostly fields.
+  const unsigned spinRounds;
+  const chrono::milliseconds idleTimeout;
+  alignas(cacheLine) atomic<unsigned> numSleeping;
+  mutex sleep_mutex;
+  condition_variable sleep_cv;
+
+  // every deque which may contain work, so that thieves can find it
+  alignas(cacheLine) unique_ptr<atomic<WorkDeque *>[]> deques;
+  atomic<unsigned> numDeques;
+  vector<WorkDeque *> freeDeques;
+  mutex deques_mutex; // only taken when a thread gains or loses a deque
+
+  // fibers which can carry on: ready ones because what they were waiting for
+  // is Done, yielded ones to check on a group again
+  alignas(cacheLine) atomic<unsigned> numWaitingFibers;
+  vector<Fiber *> readyFibers;
+  vector<Fiber *> yieldedFibers;
+  mutex fibers_mutex;
+  atomic<unsigned> numBlockedFibers; // put aside until a job is Done
+
+  // workers held in quiesce while the process forks
+  unsigned numQuiesced; // guarded by fork_mutex
+  mutex fork_mutex;
+  condition_variable fork_cv;
+
+  void do_work(Worker *w);
+  void runOnFiber(Job *j);
+  void switchTo(Fiber *f);
+  Fiber *takeFiber(vector<Fiber *> &fibers);
+  bool hasWork() const;
+  bool fibersInFlight() const;
+  void quiesce();
+  bool park(Worker *w);
+  void wakeOne();
+  void startWorker();
+  void offer(Job *j, size_t frameSize);
+  template <typename Pred> void helpUntil(Pred done, const Job *hint);
+
+public:
+  ThreadPool();
+  ~ThreadPool();
+  void dumpStats() const;
+  void writeTrace() const;
+  Job *steal();
+  WorkDeque *acquireDeque();
+  void releaseDeque(WorkDeque *d);
+  bool assignJob(Job *j, size_t frameSize);
+  void join(Job *j);
+  void join(hydra_group *g);
+  void makeReady(Fiber *f);
+  void prepareFork();
+  void afterForkInParent();
+  void afterForkInChild();
+};
+}
+
+// the pool which SIGUSR1 dumps the stats of, while it's alive
+static atomic<const ThreadPool *> livePool{ nullptr };
+static void dumpStatsOnSignal(int);
+
+// the pool which fork() has to look after, while it's alive
+static ThreadPool *forkPool{ nullptr };
+static void prepareFork();
+static void afterForkInParent();
+static void afterForkInChild();
+
+ThreadPool::ThreadPool()
+    : numThreads{ numWorkerThreads() },
+      maxDeques{ numThreads + numExternalDeques }, stop{ false },
+      forking{ false },
+      numRunning{ 0u }, spinRounds{ envUnsigned("HYDRA_SPIN", 100u) },
+      idleTimeout{ envUnsigned("HYDRA_IDLE_TIMEOUT", 1000u) },
+      numSleeping{ 0u }, deques{ new atomic<WorkDeque *>[maxDeques] },
+      numDeques{ 0u }, numWaitingFibers{ 0u }, numBlockedFibers{ 0u },
+      numQuiesced{ 0u } {
+  DEBUG(console_mutex.lock());
+  DEBUG(puts("ThreadPool::ThreadPool()"));
+  DEBUG(console_mutex.unlock());
+
+  traceEpoch = nowNs();
+
+  const char *inlineNs{ getenv("HYDRA_INLINE_NS") };
+  inlineThresholdNs = inlineNs && *inlineNs
+                          ? envUnsigned("HYDRA_INLINE_NS", 0u)
+                          : measureSpawnOverhead();
+
+  const auto placement = placeWorkers(numThreads);
+
+  // every worker's deque is registered up front, so that thieves needn't
+  // care which workers are running
+  workers.reserve(numThreads);
+  for (unsigned i{ 0u }; i < numThreads; ++i) {
+    workers.push_back(newAligned<Worker>());
+    if (!placement.empty()) {
+      workers[i]->node = static_cast<int>(placement[i].node);
+      workers[i]->cpu = static_cast<int>(placement[i].cpu);
+    }
+    deques[i] = &workers[i]->deque;
+  }
+  numDeques = numThreads;
+
+#ifdef __linux__
+  // prefer the worker pinned to each CPU, then the first one on its node, and
+  // otherwise share the CPUs out
+  if (jobPlacement == CPUPlacement && numThreads) {
+    for (const auto &c : readTopology()) {
+      if (c.cpu >= cpuWorkers.size()) {
+        cpuWorkers.resize(c.cpu + 1u);
+      }
+      auto onCPU = [&](const Worker *w) {
+        return w->cpu == static_cast<int>(c.cpu);
+      };
+      auto onNode = [&](const Worker *w) {
+        return w->node == static_cast<int>(c.node);
+      };
+      auto it = find_if(workers.begin(), workers.end(), onCPU);
+      if (it == workers.end()) {
+        it = find_if(workers.begin(), workers.end(), onNode);
+      }
+      cpuWorkers[c.cpu] = it == workers.end()
+                              ? c.cpu % numThreads
+                              : static_cast<unsigned>(it - workers.begin());
+    }
+  }
+#endif
+
+  if (statsFormat != NoStats) {
+    livePool.store(this, memory_order_relaxed);
+    struct sigaction sa{};
+    sa.sa_handler = dumpStatsOnSignal;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGUSR1, &sa, nullptr);
+  }
+
+  // handlers can't be unregistered, so they only act while forkPool is set
+  static once_flag atforkOnce;
+  call_once(atforkOnce, [] {
+    pthread_atfork(::prepareFork, ::afterForkInParent, ::afterForkInChild);
+  });
+  forkPool = this;
+}
+
+ThreadPool::~ThreadPool() {
+  DEBUG(console_mutex.lock());
+  DEBUG(puts("ThreadPool::~ThreadPool()"));
+  DEBUG(console_mutex.unlock());
+
+  forkPool = nullptr;
+
+  // signal all threads to stop, then join on them
+  stop = true;
+  {
+    auto l = unique_lock<mutex>(sleep_mutex);
+    sleep_cv.notify_all();
+  }
+  {
+    auto l = unique_lock<mutex>(workers_mutex);
+    for (auto *w : workers) {
+      if (w->t.joinable()) {
+        w->t.join();
+      }
+    }
+  }
+
+  if (statsFormat != NoStats) {
+    livePool.store(nullptr, memory_order_relaxed);
+    dumpStats();
+  }
+  if (traceFile) {
+    writeTrace();
+  }
+
+  for (auto *w : workers) {
+    deleteAligned(w);
+  }
+
+  // free the deques which were handed out to threads outside the pool
+  for (unsigned i{ numThreads }; i < numDeques; ++i) {
+    deleteAligned(deques[i].load());
+  }
+}
+
+// write every thread's counters to stderr. This may be called from a signal
+// handler, so it neither allocates nor takes locks, and a thread's counters
+// may be a moment out of date.
+void ThreadPool::dumpStats() const {
+  StatsWriter out;
+  const unsigned n{ numDeques.load(memory_order_acquire) };
+  uint64_t totals[NumCounters] = {};
 
-static constexpr unsigned numThreads{ NUM_THREADS };
+  if (statsFormat == JSONStats) {
+    out.str("{\"threads\":[");
+  } else {
+    out.str("hydra: thread pool stats\n").str("thread", 13);
+    for (auto *name : counterNames) {
+      out.str(name, 15);
+    }
+    out.str("\n");
+  }
 
-using namespace std;
+  for (unsigned i{ 0u }; i < n; ++i) {
+    const auto &counts = deques[i].load(memory_order_relaxed)->stats.counts;
+    const bool worker{ i < numThreads };
+    const unsigned index{ worker ? i : i - numThreads };
 
-// global mutex for writting to the console
-DEBUG(static mutex console_mutex);
+    if (statsFormat == JSONStats) {
+      out.str(i ? ",{" : "{").str("\"thread\":\"");
+      out.str(worker ? "worker" : "external").str("\",\"index\":").num(index);
+    } else {
+      out.str(worker ? "worker" : "external", 9).num(index, 4);
+    }
 
-static void call_with_args(unsigned num_args, void (*f)(void), void **args) {
-  DEBUG(console_mutex.lock());
-  DEBUG(cerr << "call_with_args() by " << this_thread::get_id() << "\n");
-  DEBUG(console_mutex.unlock());
+    for (unsigned c{ 0u }; c < NumCounters; ++c) {
+      const uint64_t value{ counts[c].load(memory_order_relaxed) };
+      totals[c] += value;
+      if (statsFormat == JSONStats) {
+        out.str(",\"").str(counterNames[c]).str("\":").num(value);
+      } else {
+        out.num(value, 15);
+      }
+    }
+    out.str(statsFormat == JSONStats ? "}" : "\n");
+  }
 
-  assert(f);
-  assert(args);
-  assert(num_args == 0u || *args);
+  if (statsFormat == JSONStats) {
+    out.str("],\"total\":{");
+  } else {
+    out.str("total", 13);
+  }
+  for (unsigned c{ 0u }; c < NumCounters; ++c) {
+    if (statsFormat == JSONStats) {
+      out.str(c ? ",\"" : "\"").str(counterNames[c]).str("\":").num(totals[c]);
+    } else {
+      out.num(totals[c], 15);
+    }
+  }
+  out.str(statsFormat == JSONStats ? "}}\n" : "\n");
+}
 
-  // select which call based on number of arguments
-  switch (num_args) {
-  case 0u: {
-    f();
+// write every thread's trace to traceFile, one row per deque
+void ThreadPool::writeTrace() const {
+  FILE *out{ fopen(traceFile, "w") };
+  if (!out) {
+    perror(traceFile);
     return;
   }
 
-  case 1u: {
-    auto g = (void (*)(void *))f;
-    g(args[0]);
-    return;
+  const int pid{ static_cast<int>(getpid()) };
+  const unsigned n{ numDeques.load(memory_order_acquire) };
+  const char *sep{ "" };
+
+  fputs("{\"traceEvents\":[\n", out);
+  for (unsigned tid{ 0u }; tid < n; ++tid) {
+    const auto *d = deques[tid].load(memory_order_relaxed);
+    const bool worker{ tid < numThreads };
+    fprintf(out, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,"
+                 "\"tid\":%u,\"args\":{\"name\":\"%s %u\"}}",
+            sep, pid, tid, worker ? "worker" : "external",
+            worker ? tid : tid - numThreads);
+    sep = ",\n";
+
+    if (!d->trace) {
+      continue;
+    }
+
+    d->trace->forEach([&](const TraceEvent &e) {
+      const double ts{ e.start / 1000.0 }, dur{ e.dur / 1000.0 };
+      switch (e.kind) {
+      case SpawnEvent:
+        // an instant, plus the start of an arrow to wherever the job ran
+        fprintf(out, ",\n{\"name\":\"spawn %p\",\"cat\":\"spawn\","
+                     "\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f,\"pid\":%d,"
+                     "\"tid\":%u}",
+                e.fn, ts, pid, tid);
+        fprintf(out, ",\n{\"name\":\"job\",\"cat\":\"job\",\"ph\":\"s\","
+                     "\"id\":%llu,\"ts\":%.3f,\"pid\":%d,\"tid\":%u}",
+                static_cast<unsigned long long>(e.id), ts, pid, tid);
+        break;
+      case RunEvent:
+        fprintf(out, ",\n{\"name\":\"job\",\"cat\":\"job\",\"ph\":\"f\","
+                     "\"bp\":\"e\",\"id\":%llu,\"ts\":%.3f,\"pid\":%d,"
+                     "\"tid\":%u}",
+                static_cast<unsigned long long>(e.id), ts, pid, tid);
+        fprintf(out, ",\n{\"name\":\"%p\",\"cat\":\"run\",\"ph\":\"X\","
+                     "\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%u}",
+                e.fn, ts, dur, pid, tid);
+        break;
+      case InlineEvent:
+        fprintf(out, ",\n{\"name\":\"%p\",\"cat\":\"inline\","
+                     "\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,"
+                     "\"tid\":%u}",
+                e.fn, ts, dur, pid, tid);
+        break;
+      case JoinWaitEvent:
+        fprintf(out, ",\n{\"name\":\"join %s\",\"cat\":\"join\","
+                     "\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,"
+                     "\"tid\":%u}",
+                e.fn ? "task" : "group", ts, dur, pid, tid);
+        break;
+      }
+    });
   }
+  fputs("\n]}\n", out);
+  fclose(out);
+}
 
-  case 2u: {
-    auto g = (void (*)(void *, void *))f;
-    g(args[0], args[1]);
-    return;
+static void dumpStatsOnSignal(int) {
+  if (auto *tp = livePool.load(memory_order_relaxed)) {
+    tp->dumpStats();
   }
+}
 
-  case 3u: {
-    auto g = (void (*)(void *, void *, void *))f;
-    g(args[0], args[1], args[2]);
+// start the first worker which isn't running, if there is one
+void ThreadPool::startWorker() {
+  auto l = unique_lock<mutex>(workers_mutex);
+  if (stop.load(memory_order_relaxed)) {
     return;
   }
 
-  case 4u: {
-    auto g = (void (*)(void *, void *, void *, void *))f;
-    g(args[0], args[1], args[2], args[3]);
+  for (auto *w : workers) {
+    if (w->running) {
+      continue;
+    }
+
+    // a retired worker's thread may still be on its way out
+    if (w->t.joinable()) {
+      w->t.join();
+    }
+    w->running = true;
+    numRunning.fetch_add(1u, memory_order_relaxed);
+    w->t = thread{ &ThreadPool::do_work, this, w };
+    if (w->cpu >= 0) {
+      pinThread(w->t, static_cast<unsigned>(w->cpu));
+    }
     return;
   }
+}
 
-  case 5u: {
-    auto g = (void (*)(void *, void *, void *, void *, void *))f;
-    g(args[0], args[1], args[2], args[3], args[4]);
-    return;
+void ThreadPool::do_work(Worker *w) {
+  DEBUG(console_mutex.lock());
+  DEBUG(cerr << "do_work() by " << this_thread::get_id() << "\n");
+  DEBUG(console_mutex.unlock());
+
+  assert(w);
+  auto *d = &w->deque;
+  localDeque = d;
+  localNode = w->node;
+
+  unsigned failedRounds{ 0u };
+  while (!stop.load(memory_order_relaxed)) {
+    // hold still while the process forks, once no fiber needs us to carry on
+    if (forking.load(memory_order_seq_cst) && !fibersInFlight()) {
+      quiesce();
+      failedRounds = 0u;
+      continue;
+    }
+
+    // a fiber which can carry on is further along than anything new
+    if (fibersEnabled) {
+      if (Fiber *f = takeFiber(readyFibers)) {
+        switchTo(f);
+        failedRounds = 0u;
+        continue;
+      }
+    }
+
+    // take anything offered to us first, then our own (most recently
+    // spawned) work, then try to steal some
+    Job *j{ jobPlacement ? w->takeOffer() : nullptr };
+    if (j) {
+      count(Placed);
+    } else {
+      j = d->pop();
+      if (!j) {
+        j = steal();
+      }
+    }
+
+    Fiber *f{ nullptr };
+    if (j) {
+      if (fibersEnabled) {
+        runOnFiber(j);
+      } else {
+        execute(j);
+      }
+      failedRounds = 0u;
+    } else if (fibersEnabled && (f = takeFiber(yieldedFibers))) {
+      switchTo(f);
+    } else if (failedRounds < spinRounds) {
+      // give another thread a chance
+      ++failedRounds;
+      this_thread::yield();
+    } else if (park(w)) {
+      return;
+    } else {
+      failedRounds = 0u;
+    }
   }
+}
 
-  case 6u: {
-    auto g = (void (*)(void *, void *, void *, void *, void *, void *))f;
-    g(args[0], args[1], args[2], args[3], args[4], args[5]);
+// run j, which hasn't been claimed yet, on a fiber
+void ThreadPool::runOnFiber(Job *j) {
+  if (!claim(j)) {
     return;
   }
+  auto &spare = scheduler().spareFibers;
+  Fiber *f{ spare.empty() ? newFiber() : spare.back() };
+  if (!spare.empty()) {
+    spare.pop_back();
+  }
+  f->job = j;
+  switchTo(f);
+}
 
-  case 7u: {
-    auto g =
-        (void (*)(void *, void *, void *, void *, void *, void *, void *))f;
-    g(args[0], args[1], args[2], args[3], args[4], args[5], args[6]);
-    return;
+// run f until it finishes its job or is put aside, then deal with whichever
+void ThreadPool::switchTo(Fiber *f) {
+  // a worker's own stack never moves thread, so s stays valid
+  auto &s = scheduler();
+  s.current = f;
+  swapcontext(&s.ctx, &f->ctx);
+  s.current = nullptr;
+
+  switch (s.exit) {
+  case Finished:
+    if (s.spareFibers.size() < 16u) {
+      s.spareFibers.push_back(f);
+    } else {
+      deleteFiber(f);
+    }
+    break;
+
+  case Waiting: {
+    // f's context is saved, so it can be handed over. If the job finished
+    // in the meantime, f can carry on at once.
+    numBlockedFibers.fetch_add(1u, memory_order_relaxed);
+    Fiber *expected{ nullptr };
+    if (!s.waitingOn->waiter.compare_exchange_strong(
+            expected, f, memory_order_acq_rel, memory_order_acquire)) {
+      makeReady(f);
+    }
+    break;
   }
 
-  case 8u: {
-    auto g = (void (*)(void *, void *, void *, void *, void *, void *, void *,
-                       void *))f;
-    g(args[0], args[1], args[2], args[3], args[4], args[5], args[6], args[7]);
-    return;
+  case Yielded: {
+    auto l = unique_lock<mutex>(fibers_mutex);
+    yieldedFibers.push_back(f);
+    numWaitingFibers.fetch_add(1u, memory_order_relaxed);
+    break;
   }
   }
 }
 
-namespace {
-struct Job {
-  unsigned num_args;
-  void (*f)(void);
-  void *args[8];
-};
+Fiber *ThreadPool::takeFiber(vector<Fiber *> &fibers) {
+  if (numWaitingFibers.load(memory_order_relaxed) == 0u) {
+    return nullptr;
+  }
+  auto l = unique_lock<mutex>(fibers_mutex);
+  if (fibers.empty()) {
+    return nullptr;
+  }
+  // oldest first, so that no fiber is left behind
+  Fiber *f{ fibers.front() };
+  fibers.erase(fibers.begin());
+  numWaitingFibers.fetch_sub(1u, memory_order_relaxed);
+  return f;
 }
 
-// do not look/modify j or stop unless you hold m
-static void do_work(Job *j, mutex *m, atomic<bool> *valid, bool *stop) {
+void ThreadPool::makeReady(Fiber *f) {
+  {
+    auto l = unique_lock<mutex>(fibers_mutex);
+    readyFibers.push_back(f);
+    numWaitingFibers.fetch_add(1u, memory_order_relaxed);
+  }
+  numBlockedFibers.fetch_sub(1u, memory_order_relaxed);
+
+  // pairs with the fetch_add in park(), as in assignJob
+  atomic_thread_fence(memory_order_seq_cst);
+  if (numSleeping.load(memory_order_relaxed) > 0u) {
+    wakeOne();
+  }
+}
+
+// returns true if any deque looks like it has something to steal, or there's
+// a fiber which can carry on
+bool ThreadPool::hasWork() const {
+  if (numWaitingFibers.load(memory_order_relaxed) > 0u) {
+    return true;
+  }
+  const unsigned n{ numDeques.load(memory_order_acquire) };
+  for (unsigned i{ 0u }; i < n; ++i) {
+    if (!deques[i].load(memory_order_relaxed)->empty()) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// returns true if a fiber's job hasn't finished, but isn't running either
+bool ThreadPool::fibersInFlight() const {
+  // a fiber counts as waiting before it stops counting as blocked
+  const unsigned blocked{ numBlockedFibers.load(memory_order_acquire) };
+  return blocked + numWaitingFibers.load(memory_order_acquire) > 0u;
+}
+
+// wait, holding no job, until the process has forked
+void ThreadPool::quiesce() {
+  auto l = unique_lock<mutex>(fork_mutex);
+  ++numQuiesced;
+  fork_cv.notify_all();
+  fork_cv.wait(l, [this] { return !forking.load(memory_order_relaxed); });
+  --numQuiesced;
+}
+
+// sleep until assignJob or the destructor wakes us up; returns true if w has
+// been idle for so long that it should exit
+bool ThreadPool::park(Worker *w) {
+  auto l = unique_lock<mutex>(sleep_mutex);
+
+  // announce that we're going to sleep before the final check for work, so
+  // that a concurrent assignJob either sees us or we see its job
+  numSleeping.fetch_add(1u, memory_order_seq_cst);
+  atomic_thread_fence(memory_order_seq_cst);
+  bool retire{ false };
+  if (!stop.load(memory_order_relaxed) && !hasWork()) {
+    count(Parks);
+    if (idleTimeout.count() == 0) {
+      sleep_cv.wait(l);
+    } else if (sleep_cv.wait_for(l, idleTimeout) == cv_status::timeout) {
+      // anything published before wakeOne took sleep_mutex is visible here,
+      // so a job can't be stranded by our leaving
+      retire = !stop.load(memory_order_relaxed) && !hasWork();
+    }
+  }
+  // pairs with prepareFork: either it counts us as sleeping, or we see that
+  // it's forking before we look for work again
+  numSleeping.fetch_sub(1u, memory_order_seq_cst);
+
+  if (retire) {
+    auto wl = unique_lock<mutex>(workers_mutex, try_to_lock);
+    if (!wl.owns_lock()) {
+      // someone is starting or stopping workers, so just go round again
+      return false;
+    }
+    w->running = false;
+    numRunning.fetch_sub(1u, memory_order_relaxed);
+  }
+  return retire;
+}
+
+// wake a sleeping worker, or start another one if none are asleep
+void ThreadPool::wakeOne() {
+  {
+    // taking sleep_mutex means the notify can't slip in between a worker's
+    // final check for work and it going to sleep
+    auto l = unique_lock<mutex>(sleep_mutex);
+    if (numSleeping.load(memory_order_relaxed) > 0u) {
+      sleep_cv.notify_one();
+      return;
+    }
+  }
+  startWorker();
+}
+
+// try each deque once, starting from a random one. Pinned workers try the
+// other workers on their own NUMA node first, so that work (and the data it
+// touches) only crosses nodes when there's nothing left nearby.
+Job *ThreadPool::steal() {
+  if (localNode >= 0) {
+    const unsigned start{ nextRandom() % numThreads };
+    for (unsigned i{ 0u }; i < numThreads; ++i) {
+      auto *w = workers[(start + i) % numThreads];
+      if (w->node != localNode || &w->deque == localDeque) {
+        continue;
+      }
+      if (Job *j = w->deque.steal()) {
+        count(Steals);
+        return j;
+      }
+    }
+  }
+
+  const unsigned n{ numDeques.load(memory_order_acquire) };
+  const unsigned start{ n ? nextRandom() % n : 0u };
+  for (unsigned i{ 0u }; i < n; ++i) {
+    auto *d = deques[(start + i) % n].load(memory_order_relaxed);
+    if (d == localDeque) {
+      continue;
+    }
+    if (Job *j = d->steal()) {
+      count(Steals);
+      return j;
+    }
+  }
+  count(FailedSteals);
+  return nullptr;
+}
+
+// give a thread from outside the pool a deque of its own, or nullptr if
+// there are none left
+WorkDeque *ThreadPool::acquireDeque() {
+  auto l = unique_lock<mutex>(deques_mutex);
+
+  if (!freeDeques.empty()) {
+    auto *d = freeDeques.back();
+    freeDeques.pop_back();
+    return d;
+  }
+
+  const unsigned n{ numDeques.load(memory_order_relaxed) };
+  if (n == maxDeques) {
+    return nullptr;
+  }
+
+  // deques are never removed from deques[], so thieves can't be left
+  // holding a dangling pointer
+  auto *d = newAligned<WorkDeque>();
+  deques[n].store(d, memory_order_relaxed);
+  numDeques.store(n + 1u, memory_order_release);
+  return d;
+}
+
+void ThreadPool::releaseDeque(WorkDeque *d) {
+  auto l = unique_lock<mutex>(deques_mutex);
+  freeDeques.push_back(d);
+}
+
+// publish j so that it can be run by any thread; returns false if this thread
+// has nowhere to queue it
+bool ThreadPool::assignJob(Job *j, const size_t frameSize) {
   DEBUG(console_mutex.lock());
-  DEBUG(cerr << "do_work() by " << this_thread::get_id() << "\n");
+  DEBUG(puts("ThreadPool::assignJob()"));
   DEBUG(console_mutex.unlock());
 
-  assert(j);
-  assert(m);
-  assert(valid);
-  assert(stop);
+  if (!localDeque || localDeque->full()) {
+    return false;
+  }
+
+  j->state.store(Pending, memory_order_release);
+  localDeque->push(j);
+  count(Spawned);
+  if (jobPlacement) {
+    offer(j, frameSize);
+  }
+
+  // pairs with the fetch_add in park()
+  atomic_thread_fence(memory_order_seq_cst);
+  if (numSleeping.load(memory_order_relaxed) > 0u ||
+      numRunning.load(memory_order_relaxed) < numThreads) {
+    wakeOne();
+  }
+  return true;
+}
+
+// offer j to the worker jobPlacement prefers for it. If that worker is busy,
+// j may be stolen from our deque as usual, and the offer is left stale.
+void ThreadPool::offer(Job *j, const size_t frameSize) {
+  if (numThreads == 0u) {
+    return;
+  }
+
+  unsigned home;
+  if (jobPlacement == ArgsPlacement) {
+    uint64_t key{ reinterpret_cast<uintptr_t>(j->frame) };
+    if (frameSize) {
+      key = 0u;
+      memcpy(&key, j->frame, min(frameSize, sizeof(key)));
+    }
+    // Fibonacci hashing, so that aligned pointers still spread out
+    home = static_cast<unsigned>((key * 0x9E3779B97F4A7C15ull) >> 32) %
+           numThreads;
+  } else {
+#ifdef __linux__
+    const int cpu{ sched_getcpu() };
+#else
+    const int cpu{ 0 };
+#endif
+    const unsigned c{ static_cast<unsigned>(max(cpu, 0)) };
+    home = c < cpuWorkers.size() ? cpuWorkers[c] : c % numThreads;
+  }
+
+  auto *w = workers[home];
+  if (&w->deque != localDeque) {
+    const unsigned slot{ w->mailboxNext.fetch_add(1u, memory_order_relaxed) };
+    w->mailbox[slot % Worker::mailboxSize].store(j, memory_order_release);
+  }
+}
 
-  bool shutdown;
-  do {
-    // lock m to prevent changes to j and stop
-    unique_lock<mutex> l(*m);
+// the first offer which still looks unclaimed, if any
+Job *Worker::takeOffer() {
+  for (auto &m : mailbox) {
+    if (!m.load(memory_order_relaxed)) {
+      continue;
+    }
+    Job *j{ m.exchange(nullptr, memory_order_acquire) };
+    if (j && j->state.load(memory_order_relaxed) == Pending) {
+      return j;
+    }
+  }
+  return nullptr;
+}
 
-    // check if we've been told to shutdown
-    shutdown = *stop;
+// run other work until done() holds, rather than sit idle: first our own,
+// then anything spawned by hint's runner (which is likely to be what hint is
+// waiting on), then anything at all
+template <typename Pred>
+void ThreadPool::helpUntil(Pred done, const Job *hint) {
+  const bool timed{ statsFormat != NoStats || traceFile };
+  const uint64_t start{ timed ? nowNs() : 0u };
+  const uint64_t charged{ timed ? chargedNs() : 0u };
 
-    // check if we've been given a job
-    if (valid->load()) {
-      // do the work
-      call_with_args(j->num_args, j->f, j->args);
+  while (!done()) {
+    Job *k{ localDeque ? localDeque->pop() : nullptr };
+    if (!k && hint) {
+      auto *r = hint->runner.load(memory_order_relaxed);
+      if (r && r != localDeque) {
+        k = r->steal();
+        if (k) {
+          count(Steals);
+        }
+      }
+    }
+    if (!k) {
+      k = steal();
+    }
 
-      // tell the ThreadPool that we did the work
-      valid->store(false);
+    if (k) {
+      execute(k);
     } else {
-      // give another thread a chance
-      l.unlock();
       this_thread::yield();
     }
-  } while (!shutdown);
+  }
+
+  if (timed) {
+    const uint64_t end{ nowNs() };
+    count(JoinWaitNs, end - start - (chargedNs() - charged));
+    if (traceFile) {
+      traceEvent(JoinWaitEvent, hint ? (const void *)hint->f : nullptr,
+                 hint ? hint->traceId : 0u, start, end);
+    }
+  }
 }
 
-namespace {
-class ThreadPool {
-  Job jobs[numThreads];
-  mutex mutexes[numThreads];
-  bool stops[numThreads];
-  thread threads[numThreads];
-  atomic<bool> hasJobs[numThreads];
-  bool available[numThreads];
-  mutex available_mutex;
+// jobs which were run without being popped leave stale pointers behind, so
+// clear any off the bottom of our deque before it fills up with them
+static FRESH_TLS void trimLocalDeque() {
+  if (localDeque) {
+    while (Job *k = localDeque->peek()) {
+      if (k->state.load(memory_order_relaxed) == Pending) {
+        break;
+      }
+      localDeque->pop();
+    }
+  }
+}
 
-public:
-  ThreadPool();
-  ~ThreadPool();
-  unsigned assignJob(unsigned num_args, void *arg1, void *arg2, void *arg3,
-                     void *arg4, void *arg5, void *arg6, void *arg7, void *arg8,
-                     void (*f)(void));
-  void join(unsigned threadID);
-};
+// recycle j once it has been joined
+static FRESH_TLS void finishJoin(Job *j) {
+  j->state.store(Free, memory_order_relaxed);
+  jobCache.put(j);
+  trimLocalDeque();
 }
 
-ThreadPool::ThreadPool() {
+// return once j has been run, running it here if nobody has started it
+void ThreadPool::join(Job *j) {
   DEBUG(console_mutex.lock());
-  DEBUG(puts("ThreadPool::ThreadPool()"));
+  DEBUG(puts("ThreadPool::join()"));
   DEBUG(console_mutex.unlock());
 
-  for (unsigned i{ 0u }; i < numThreads; ++i) {
-    stops[i] = false;
-    hasJobs[i] = false;
-    available[i] = true;
-    threads[i] =
-        thread{ &do_work, &jobs[i], &mutexes[i], &hasJobs[i], &stops[i] };
+  assert(j);
+
+  if (!execute(j)) {
+    if (fibersEnabled && onFiber()) {
+      // run our own children, then put this fiber aside until j is Done
+      while (j->state.load(memory_order_acquire) != Done) {
+        if (!runOwnJob()) {
+          suspendFiber(j);
+        }
+      }
+    } else {
+      helpUntil([j] { return j->state.load(memory_order_acquire) == Done; },
+                j);
+    }
   }
+
+  finishJoin(j);
 }
 
-ThreadPool::~ThreadPool() {
+// return once every job in g has been run
+void ThreadPool::join(hydra_group *g) {
   DEBUG(console_mutex.lock());
-  DEBUG(puts("ThreadPool::~ThreadPool()"));
+  DEBUG(puts("ThreadPool::join(group)"));
   DEBUG(console_mutex.unlock());
 
-  // signal all threads to stop
-  for (unsigned i{ 0u }; i < numThreads; ++i) {
-    mutexes[i].lock();
-    stops[i] = true;
-    mutexes[i].unlock();
+  assert(g);
+
+  if (fibersEnabled && onFiber()) {
+    // nobody tells a group's joiner when it's done, so keep checking
+    while (g->pending.load(memory_order_acquire) != 0u) {
+      if (!runOwnJob()) {
+        suspendFiber(nullptr);
+      }
+    }
+  } else if (g->pending.load(memory_order_acquire) != 0u) {
+    helpUntil([g] { return g->pending.load(memory_order_acquire) == 0u; },
+              nullptr);
   }
+  trimLocalDeque();
+}
+
+// A child process only has the thread which forked it, so jobs which other
+// threads were in the middle of would never be finished there. Before a fork,
+// hold the workers still until none of them is running a job (pending jobs
+// stay queued, and are safe to run on either side), and take every lock the
+// pool has, so that the child gets a consistent copy.
+void ThreadPool::prepareFork() {
+  {
+    auto l = unique_lock<mutex>(fork_mutex);
+    forking.store(true, memory_order_seq_cst);
+
+    // a job which forks can't wait for the others, as they may be waiting
+    // for it
+    bool inJob{ onFiber() };
+    for (auto *w : workers) {
+      inJob = inJob || &w->deque == localDeque;
+    }
 
-  // join on all threads
-  for (auto &t : threads) {
-    t.join();
+    if (inJob) {
+      fputs("hydra: fork() inside a spawned function; the child may hang "
+            "joining jobs which were running\n",
+            stderr);
+    } else {
+      // a worker which is neither held nor asleep may be running a job
+      while (numQuiesced + numSleeping.load(memory_order_seq_cst) <
+                 numRunning.load(memory_order_seq_cst) ||
+             fibersInFlight()) {
+        fork_cv.wait_for(l, chrono::milliseconds{ 1 });
+      }
+    }
   }
+
+  workers_mutex.lock();
+  sleep_mutex.lock();
+  deques_mutex.lock();
+  fibers_mutex.lock();
+  free_jobs_mutex.lock();
 }
 
-// returns positive ThreadID if successful, or negative value if unsuccessful
-unsigned ThreadPool::assignJob(const unsigned num_args, void *arg1, void *arg2,
-                               void *arg3, void *arg4, void *arg5, void *arg6,
-                               void *arg7, void *arg8, void (*f)(void)) {
-  DEBUG(console_mutex.lock());
-  DEBUG(puts("ThreadPool::assignJob()"));
-  DEBUG(console_mutex.unlock());
+void ThreadPool::afterForkInParent() {
+  free_jobs_mutex.unlock();
+  fibers_mutex.unlock();
+  deques_mutex.unlock();
+  sleep_mutex.unlock();
+  workers_mutex.unlock();
 
-  auto l1 = unique_lock<mutex>(available_mutex);
+  auto l = unique_lock<mutex>(fork_mutex);
+  forking.store(false, memory_order_relaxed);
+  fork_cv.notify_all();
+}
 
-  // find a thread which isn't busy
-  for (unsigned i{ 0u }; i < numThreads; ++i) {
-    if (available[i]) {
-      // lock mutexes[i] to prevent the thread from reading the job while we
-      // change it.
-      auto l2 = unique_lock<mutex>(mutexes[i]);
+// the child has none of the workers, so forget them; spawns start new ones as
+// they're needed, and joins run whatever was still queued themselves
+void ThreadPool::afterForkInChild() {
+  for (auto *w : workers) {
+    // the thread handles refer to threads which don't exist here, so they
+    // can't be joined or destroyed
+    new (&w->t) thread{};
+    w->running = false;
+  }
+  numRunning.store(0u, memory_order_relaxed);
+  numSleeping.store(0u, memory_order_relaxed);
+  numQuiesced = 0u;
+  forking.store(false, memory_order_relaxed);
+
+  // the other threads were waiting on these
+  new (&sleep_cv) condition_variable{};
+  new (&fork_cv) condition_variable{};
+
+  free_jobs_mutex.unlock();
+  fibers_mutex.unlock();
+  deques_mutex.unlock();
+  sleep_mutex.unlock();
+  workers_mutex.unlock();
+}
 
-      // update jobs[i] to the job we want
-      auto &j = jobs[i];
-      j.num_args = num_args;
-      j.f = f;
-      j.args[0] = arg1;
-      j.args[1] = arg2;
-      j.args[2] = arg3;
-      j.args[3] = arg4;
-      j.args[4] = arg5;
-      j.args[5] = arg6;
-      j.args[6] = arg7;
-      j.args[7] = arg8;
+static void prepareFork() {
+  if (forkPool) {
+    forkPool->prepareFork();
+  }
+}
+
+static void afterForkInParent() {
+  if (forkPool) {
+    forkPool->afterForkInParent();
+  }
+}
+
+static void afterForkInChild() {
+  if (forkPool) {
+    forkPool->afterForkInChild();
+  }
+}
 
-      // signal to the thread that it has a job to do
-      hasJobs[i] = true;
+// the pool is built by the first spawn, so a program which never reaches a
+// parallelised call doesn't pay for one
+static ThreadPool &pool() {
+  static ThreadPool tp{};
+  return tp;
+}
+
+static void makeReady(Fiber *f) { pool().makeReady(f); }
 
-      // note that the thread isn't available
-      available[i] = false;
+namespace {
+// hands a deque back to the pool when a thread outside the pool exits
+struct DequeOwner {
+  WorkDeque *d{ nullptr };
+  ~DequeOwner() {
+    if (d) {
+      pool().releaseDeque(d);
+    }
+  }
+};
+}
 
-      // tell the caller the threadID of the thread
-      return i;
+static thread_local DequeOwner dequeOwner;
+static atomic<uint64_t> nextTraceId{ 1u };
+// account for fn, which this thread has just run itself rather than publish,
+// under counter (Inlined or Elided); it's timed from start for the trace, and
+// for site if there is one
+static FRESH_TLS void finishInline(const void *fn, const Counter counter,
+                                   const uint64_t start, Site *site) {
+  count(counter);
+  if (traceFile || site) {
+    const uint64_t end{ nowNs() };
+    if (site) {
+      site->record(end - start);
+    }
+    if (traceFile) {
+      traceEvent(InlineEvent, fn, 0u, start, end);
     }
   }
+}
+
+// run f(frame) on this thread, as a spawn that began at start couldn't be
+// published
+static void runInline(void (*f)(void *), void *frame, const uint64_t start) {
+  run(f, frame);
+  finishInline((const void *)f, Inlined, start, nullptr);
+}
+
+// a job from this thread's cache, to run f(frame) in group (or with a handle
+// if group is null), holding a jobserver token if there is a jobserver
+static Job *newJob(hydra_group *group, void (*f)(void *), void *frame) {
+  auto *j = jobCache.get();
+  j->runner.store(nullptr, memory_order_relaxed);
+  j->f = f;
+  j->frame = frame;
+  j->group = group;
+  j->site = nullptr;
+  j->waiter.store(nullptr, memory_order_relaxed);
+  j->token = jobserver != nullptr;
 
-  // all theads are busy
-  return UINT_MAX;
+  if (traceFile) {
+    j->traceId = nextTraceId.fetch_add(1u, memory_order_relaxed);
+  }
+  return j;
 }
 
-// spin until thread with threadID has finished
-void ThreadPool::join(unsigned threadID) {
+// publish f(frame) as a job in group (or with a handle if group is null), or
+// run it here if it can't be published; returns the job if it was published
+static Job *spawnJob(hydra_group *group, void (*f)(void *), void *frame,
+                     const size_t frameSize, const void *ip) {
   DEBUG(console_mutex.lock());
-  DEBUG(puts("ThreadPool::join()"));
+  DEBUG(cerr << "spawn() by " << this_thread::get_id() << "\n");
   DEBUG(console_mutex.unlock());
 
-  assert(threadID >= 0);
-  assert(threadID < numThreads);
+  assert(f);
+
+  auto &tp = pool();
+  if (!localDeque) {
+    localDeque = dequeOwner.d = tp.acquireDeque();
+  }
 
-  // wait until the thread which was supposed to do our job has finished
-  while (hasJobs[threadID]) {
-    this_thread::yield();
+  Site *site{ inlineThresholdNs ? findSite(ip) : nullptr };
+  const bool sample{ site && --sampleCountdown == 0u };
+  if (sample) {
+    sampleCountdown = samplePeriod;
   }
 
-  // aquire the available_mutex before changing available
-  auto l = unique_lock<mutex>(available_mutex);
+  const uint64_t start{ traceFile || sample ? nowNs() : 0u };
 
-  // let the ThreadPool know that the thread with threadID is free
-  available[threadID] = true;
-}
+  // if this site's jobs have been too small to be worth publishing, run this
+  // one here. Sampling carries on, so the site switches back if they grow.
+  const uint64_t avg{ site ? site->avgNs.load(memory_order_relaxed) : 0u };
+  if (avg && avg < inlineThresholdNs) {
+    run(f, frame);
+    finishInline((const void *)f, Elided, start, sample ? site : nullptr);
+    return nullptr;
+  }
 
-static ThreadPool tp{};
+  // once the host's budget is used up, this job runs here rather than adding
+  // to the threads competing for it
+  if (jobserver && sem_trywait(jobserver) != 0) {
+    runInline(f, frame, start);
+    return nullptr;
+  }
 
-static thread_local unsigned spawnCount{ 0u };
-static thread_local pair<unsigned, unsigned> taskJobPairs[numThreads];
+  auto *j = newJob(group, f, frame);
+  j->site = sample ? site : nullptr;
 
-static inline bool updateJobID(const unsigned task, const unsigned jobID) {
-  const bool success{ jobID < numThreads };
-  if (success) {
-    assert(spawnCount < numThreads);
-    taskJobPairs[spawnCount] = make_pair(task, jobID);
-    ++spawnCount;
+  // the group must count j before anyone can run it
+  if (group) {
+    group->pending.fetch_add(1u, memory_order_relaxed);
   }
-  return success;
-}
 
-void spawn(const unsigned task, void (*f)(void)) {
-  unsigned jobID = tp.assignJob(0u, nullptr, nullptr, nullptr, nullptr, nullptr,
-                                nullptr, nullptr, nullptr, f);
-  if (!updateJobID(task, jobID)) {
-    f();
+  if (tp.assignJob(j, frameSize)) {
+    if (traceFile) {
+      traceEvent(SpawnEvent, (const void *)f, j->traceId, start, start);
+    }
+    return j;
   }
-}
 
-void spawn(const unsigned task, void (*f)(void *), void *arg1) {
-  unsigned jobID = tp.assignJob(1u, arg1, nullptr, nullptr, nullptr, nullptr,
-                                nullptr, nullptr, nullptr, (void (*)(void))f);
-  if (!updateJobID(task, jobID)) {
-    f(arg1);
+  // the job was never published, so hand it back and just run f here; after
+  // f, this may be another thread, whose cache j mustn't go into
+  if (group) {
+    group->pending.fetch_sub(1u, memory_order_relaxed);
+  }
+  if (j->token) {
+    sem_post(jobserver);
   }
+  jobCache.put(j);
+  runInline(f, frame, start);
+  return nullptr;
 }
 
-void spawn(const unsigned task, void (*f)(void *, void *), void *arg1,
-           void *arg2) {
-  unsigned jobID = tp.assignJob(2u, arg1, arg2, nullptr, nullptr, nullptr,
-                                nullptr, nullptr, nullptr, (void (*)(void))f);
-  if (!updateJobID(task, jobID)) {
-    f(arg1, arg2);
+static void runRange(void *job);
+
+// publish body(frame, lo, hi) as a job in group, which whichever thread runs
+// it splits further; returns false if it couldn't be published
+static FRESH_TLS bool publishRange(hydra_group *group,
+                                   void (*body)(void *, size_t, size_t),
+                                   void *frame, const size_t lo,
+                                   const size_t hi, const size_t grain) {
+  auto &tp = pool();
+  if (!localDeque) {
+    localDeque = dequeOwner.d = tp.acquireDeque();
   }
-}
+  if (jobserver && sem_trywait(jobserver) != 0) {
+    return false;
+  }
+
+  const uint64_t start{ traceFile ? nowNs() : 0u };
+  auto *j = newJob(group, runRange, nullptr);
+  j->frame = j;
+  j->body = body;
+  j->bodyFrame = frame;
+  j->lo = lo;
+  j->hi = hi;
+  j->grain = grain;
 
-void spawn(const unsigned task, void (*f)(void *, void *, void *), void *arg1,
-           void *arg2, void *arg3) {
-  unsigned jobID = tp.assignJob(3u, arg1, arg2, arg3, nullptr, nullptr, nullptr,
-                                nullptr, nullptr, (void (*)(void))f);
-  if (!updateJobID(task, jobID)) {
-    f(arg1, arg2, arg3);
+  group->pending.fetch_add(1u, memory_order_relaxed);
+  if (tp.assignJob(j, 0u)) {
+    if (traceFile) {
+      traceEvent(SpawnEvent, (const void *)body, j->traceId, start, start);
+    }
+    return true;
+  }
+
+  group->pending.fetch_sub(1u, memory_order_relaxed);
+  if (j->token) {
+    sem_post(jobserver);
   }
+  jobCache.put(j);
+  return false;
 }
 
-void spawn(const unsigned task, void (*f)(void *, void *, void *, void *),
-           void *arg1, void *arg2, void *arg3, void *arg4) {
-  unsigned jobID = tp.assignJob(4u, arg1, arg2, arg3, arg4, nullptr, nullptr,
-                                nullptr, nullptr, (void (*)(void))f);
-  if (!updateJobID(task, jobID)) {
-    f(arg1, arg2, arg3, arg4);
+// run a job published by publishRange, grain indices at a time. Whenever the
+// thread running it has nothing queued for others to steal, it first gives
+// away the back half of what's left as another job (lazy binary splitting),
+// so a range is only split as finely as there are idle threads to take it.
+static void runRange(void *job) {
+  const auto *j = static_cast<const Job *>(job);
+  void (*const body)(void *, size_t, size_t) { j->body };
+  void *const frame{ j->bodyFrame };
+  hydra_group *const group{ j->group };
+  const size_t grain{ j->grain };
+  size_t lo{ j->lo }, hi{ j->hi };
+
+  while (lo < hi) {
+    if (hi - lo > grain) {
+      const WorkDeque *d{ currentDeque() };
+      const size_t mid{ lo + (hi - lo) / 2u };
+      if (d && d->empty() && publishRange(group, body, frame, mid, hi, grain)) {
+        countFresh(Splits);
+        hi = mid;
+        continue;
+      }
+    }
+    const size_t end{ hi - lo > grain ? lo + grain : hi };
+    body(frame, lo, end);
+    lo = end;
   }
 }
 
-void spawn(const unsigned task,
-           void (*f)(void *, void *, void *, void *, void *), void *arg1,
-           void *arg2, void *arg3, void *arg4, void *arg5) {
-  unsigned jobID = tp.assignJob(5u, arg1, arg2, arg3, arg4, arg5, nullptr,
-                                nullptr, nullptr, (void (*)(void))f);
-  if (!updateJobID(task, jobID)) {
-    f(arg1, arg2, arg3, arg4, arg5);
+// the host's executor, if it has registered one
+static atomic<const hydra_executor *> hostExecutor{ nullptr };
+
+namespace {
+// a spawn into a group which was handed to the host's executor
+struct HostTask {
+  hydra_group *group;
+  const hydra_executor *executor; // the one which spawned it
+  void *handle;
+};
+}
+
+// the host executors' handles for spawns into groups which this thread hasn't
+// joined yet
+static thread_local vector<HostTask> hostGroupTasks;
+
+hydra_task *spawnTask(hydra_group *group, void (*f)(void *), void *frame,
+                      const size_t frameSize, const void *ip) {
+  if (const hydra_executor *e = hostExecutor.load(memory_order_acquire)) {
+    void *handle{ e->spawn(e->context, f, frame) };
+    if (group && handle) {
+      hostGroupTasks.push_back(HostTask{ group, e, handle });
+      return nullptr;
+    }
+    return static_cast<hydra_task *>(handle);
   }
+  return reinterpret_cast<hydra_task *>(
+      spawnJob(group, f, frame, frameSize, ip));
 }
 
-void spawn(const unsigned task,
-           void (*f)(void *, void *, void *, void *, void *, void *),
-           void *arg1, void *arg2, void *arg3, void *arg4, void *arg5,
-           void *arg6) {
-  unsigned jobID = tp.assignJob(6u, arg1, arg2, arg3, arg4, arg5, arg6, nullptr,
-                                nullptr, (void (*)(void))f);
-  if (!updateJobID(task, jobID)) {
-    f(arg1, arg2, arg3, arg4, arg5, arg6);
+hydra_task *spawn(void (*f)(void *), void *frame) {
+  return spawnTask(nullptr, f, frame, 0u, __builtin_return_address(0));
+}
+
+void join(hydra_task *task) {
+  if (!task) {
+    return;
+  }
+  if (const hydra_executor *e = hostExecutor.load(memory_order_acquire)) {
+    e->join(e->context, task);
+  } else {
+    pool().join(reinterpret_cast<Job *>(task));
   }
 }
 
-void spawn(const unsigned task,
-           void (*f)(void *, void *, void *, void *, void *, void *, void *),
-           void *arg1, void *arg2, void *arg3, void *arg4, void *arg5,
-           void *arg6, void *arg7) {
-  unsigned jobID = tp.assignJob(7u, arg1, arg2, arg3, arg4, arg5, arg6, arg7,
-                                nullptr, (void (*)(void))f);
-  if (!updateJobID(task, jobID)) {
-    f(arg1, arg2, arg3, arg4, arg5, arg6, arg7);
+void spawn(hydra_group *group, void (*f)(void *), void *frame) {
+  assert(group);
+  spawnTask(group, f, frame, 0u, __builtin_return_address(0));
+}
+
+void join(hydra_group *group) {
+  assert(group);
+  // if the executor has changed since the group's first spawn, some of its
+  // jobs may be with an executor and the rest in the pool, so wait for both
+  for (size_t i = 0u; i < hostGroupTasks.size();) {
+    const HostTask &t = hostGroupTasks[i];
+    if (t.group == group) {
+      t.executor->join(t.executor->context, t.handle);
+      hostGroupTasks.erase(hostGroupTasks.begin() + i);
+    } else {
+      ++i;
+    }
+  }
+
+  // a thread which has never published anything needn't build the pool
+  if (localDeque || group->pending.load(memory_order_acquire) != 0u) {
+    pool().join(group);
   }
 }
 
-void spawn(const unsigned task, void (*f)(void *, void *, void *, void *,
-                                          void *, void *, void *, void *),
-           void *arg1, void *arg2, void *arg3, void *arg4, void *arg5,
-           void *arg6, void *arg7, void *arg8) {
-  unsigned jobID = tp.assignJob(8u, arg1, arg2, arg3, arg4, arg5, arg6, arg7,
-                                arg8, (void (*)(void))f);
-  if (!updateJobID(task, jobID)) {
-    f(arg1, arg2, arg3, arg4, arg5, arg6, arg7, arg8);
+// the frame stays where it is, so its size only matters for placement
+hydra_task *spawn(void (*f)(void *), void *frame, size_t frameSize) {
+  return spawnTask(nullptr, f, frame, frameSize, __builtin_return_address(0));
+}
+
+void spawn(hydra_group *group, void (*f)(void *), void *frame,
+           size_t frameSize) {
+  assert(group);
+  spawnTask(group, f, frame, frameSize, __builtin_return_address(0));
+}
+
+namespace {
+// part of a spawn_range handed to the host's executor
+struct RangePiece {
+  void (*body)(void *, size_t, size_t);
+  void *frame;
+  size_t lo, hi;
+};
+}
+
+static void runPiece(void *p) {
+  unique_ptr<RangePiece> piece{ static_cast<RangePiece *>(p) };
+  piece->body(piece->frame, piece->lo, piece->hi);
+}
+
+void spawn_range(hydra_group *group, void (*body)(void *, size_t, size_t),
+                 void *frame, const size_t begin, const size_t end,
+                 size_t grain) {
+  assert(group && body);
+  grain = max<size_t>(grain, 1u);
+  if (end <= begin) {
+    return;
+  }
+
+  // an executor doesn't split anything itself, so cut the range into a few
+  // pieces per CPU up front
+  if (const hydra_executor *e = hostExecutor.load(memory_order_acquire)) {
+    const size_t n{ end - begin };
+    const size_t pieces{ min<size_t>((n + grain - 1u) / grain,
+                                     4u * availableCPUs()) };
+    const size_t size{ (n + pieces - 1u) / pieces };
+    for (size_t lo = begin; lo < end; lo += size) {
+      auto *piece = new RangePiece{ body, frame, lo, min(lo + size, end) };
+      if (void *handle = e->spawn(e->context, runPiece, piece)) {
+        hostGroupTasks.push_back(HostTask{ group, e, handle });
+      }
+    }
+    return;
+  }
+
+  if (end - begin <= grain) {
+    body(frame, begin, end);
+  } else if (!publishRange(group, body, frame, begin, end, grain)) {
+    const uint64_t start{ traceFile ? nowNs() : 0u };
+    body(frame, begin, end);
+    finishInline((const void *)body, Inlined, start, nullptr);
   }
 }
 
-void join(const unsigned task) {
-  // join with and remove all jobs in taskJobPairs which match task
-  auto *end = remove_if(taskJobPairs, taskJobPairs + spawnCount,
-                        [task](const pair<unsigned, unsigned> &p) {
-    const bool join{ p.first == task };
-    if (join) {
-      tp.join(p.second);
+void hydra_set_executor(const hydra_executor *executor) {
+  hostExecutor.store(executor, memory_order_release);
+}
+
+size_t hydra_help() {
+  if (hostExecutor.load(memory_order_acquire)) {
+    return 0u;
+  }
+  auto &tp = pool();
+  size_t ran{ 0u };
+  while (Job *j = tp.steal()) {
+    if (execute(j)) {
+      ++ran;
     }
-    return join;
-  });
-  assert(end - taskJobPairs >= 0 && end - taskJobPairs <= numThreads);
-  spawnCount = end - taskJobPairs;
+  }
+  return ran;
 }
@@ -1,36 +1,78 @@
 // NOTE: this header is only for using the Thread Pool manually. When using on
-// code transformed by Hydra, there is no need to use this header.
+// code transformed by Hydra, there is no need to use this header. The Process
+// Pool (ProcessPool.cpp) and Remote Pool (RemotePool.cpp) implement the same
+// spawns and joins, but not the hydra_ functions at the end.
 
-void spawn(const unsigned task, void (*f)(void));
+#include <atomic>
+#include <cstddef>
 
-void spawn(const unsigned task, void (*f)(void *), void *arg1);
+// identifies one spawn until it has been joined
+struct hydra_task;
 
-void spawn(const unsigned task, void (*f)(void *, void *), void *arg1,
-           void *arg2);
+// a set of spawns which are all joined at once. It must be zeroed before its
+// first spawn, and is zero again (so may be reused) once join returns.
+struct hydra_group {
+  std::atomic<unsigned> pending;
+};
 
-void spawn(const unsigned task, void (*f)(void *, void *, void *), void *arg1,
-           void *arg2, void *arg3);
-           
-void spawn(const unsigned task, void (*f)(void *, void *, void *, void *),
-           void *arg1, void *arg2, void *arg3, void *arg4);
+// runs f(frame) asynchronously; frame points to f's packed arguments and must
+// stay alive until the matching join
+hydra_task *spawn(void (*f)(void *), void *frame);
 
-void spawn(const unsigned task,
-           void (*f)(void *, void *, void *, void *, void *), void *arg1,
-           void *arg2, void *arg3, void *arg4, void *arg5);
+// waits for the spawn which returned task; does nothing if task is null
+void join(hydra_task *task);
 
-void spawn(const unsigned task,
-           void (*f)(void *, void *, void *, void *, void *, void *),
-           void *arg1, void *arg2, void *arg3, void *arg4, void *arg5,
-           void *arg6);
+// as spawn above, but f(frame) is joined along with the rest of group
+void spawn(hydra_group *group, void (*f)(void *), void *frame);
 
-void spawn(const unsigned task,
-           void (*f)(void *, void *, void *, void *, void *, void *, void *),
-           void *arg1, void *arg2, void *arg3, void *arg4, void *arg5,
-           void *arg6, void *arg7);
+// waits for every spawn into group
+void join(hydra_group *group);
 
-void spawn(const unsigned task, void (*f)(void *, void *, void *, void *,
-                                          void *, void *, void *, void *),
-           void *arg1, void *arg2, void *arg3, void *arg4, void *arg5,
-           void *arg6, void *arg7, void *arg8);
+// as the spawns above, where frameSize is the size of *frame. This is what
+// Hydra's transformed code calls; a runtime which runs f somewhere frame can't
+// be seen (e.g. another process) copies the frame there and back again.
+hydra_task *spawn(void (*f)(void *), void *frame, size_t frameSize);
+void spawn(hydra_group *group, void (*f)(void *), void *frame,
+           size_t frameSize);
 
-void join(const unsigned task);
+// any of the spawns above: into group unless it's null, and of a frame of
+// frameSize bytes, or of one which mustn't be copied if it's 0. A runtime
+// which learns which spawns are worth making (see HYDRA_INLINE_NS) tells
+// spawns apart by where they were made; this one counts as made at ip, a
+// return address, so that a wrapper such as threading/Shim.cpp can pass on
+// its own caller's rather than have every spawn seem to come from it.
+hydra_task *spawnTask(hydra_group *group, void (*f)(void *), void *frame,
+                      size_t frameSize, const void *ip);
+
+// runs body(frame, lo, hi) over consecutive subranges which together cover
+// [begin, end), joined along with the rest of group. The whole range is
+// published as one job; whichever thread runs it gives away half of what's
+// left whenever it has nothing queued for other threads to steal, and
+// otherwise runs grain indices at a time. Every subrange shares frame.
+void spawn_range(hydra_group *group, void (*body)(void *, size_t, size_t),
+                 void *frame, size_t begin, size_t end, size_t grain);
+
+extern "C" {
+// an executor belonging to the host application, which the Thread Pool can
+// hand its spawns to instead of running them on its own workers
+struct hydra_executor {
+  void *context; // passed back to both functions
+  // run f(frame) asynchronously, returning a handle for join, or null if f
+  // has already been run
+  void *(*spawn)(void *context, void (*f)(void *), void *frame);
+  // wait for the spawn which returned handle
+  void (*join)(void *context, void *handle);
+};
+
+// send every spawn after this to executor, or back to the Thread Pool's own
+// workers if executor is null. A join of a group waits for its spawns wherever
+// they went, but a task handle must be joined before the executor changes. An
+// executor must stay alive until every spawn it was given has been joined.
+void hydra_set_executor(const hydra_executor *executor);
+
+// run jobs from the Thread Pool on the calling thread until there are none
+// left; returns how many it ran. A host's idle threads can call this to lend
+// themselves to the pool (e.g. with HYDRA_NUM_THREADS=0, so it has no workers
+// of its own).
+size_t hydra_help(void);
+}